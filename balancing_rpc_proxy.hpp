@@ -0,0 +1,738 @@
+//
+//  Copyright (C) 2017 Danny Havenith
+//
+//  Distributed under the Boost Software License, Version 1.0. (See
+//  accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt)
+//
+#ifndef BALANCING_RPC_PROXY_HPP_
+#define BALANCING_RPC_PROXY_HPP_
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "rpc_proxy_pool.hpp"
+#include "binary_function_marshaller.hpp"
+#include "latency_histogram.hpp"
+
+/**
+ * Options for hedged calls of idempotent functions.
+ *
+ * A hedged call is sent to a second service if the first one has not replied
+ * within a delay. The delay is a percentile of the latencies of recent calls.
+ */
+struct HedgingOptions
+{
+    /// The percentile (0..1) of recent latencies after which a call is hedged.
+    double percentile = 0.95;
+
+    /// The delay to use until enough latencies have been measured.
+    RpcProxy::Clock::duration initialDelay = std::chrono::milliseconds( 10);
+
+    /// The maximum number of hedged calls, as a fraction of all calls of idempotent functions.
+    double budget = 0.05;
+};
+
+/**
+ * Options of a BalancingRpcProxy.
+ */
+struct BalancingRpcProxyOptions
+{
+    /// Options for the connection pool to each of the services.
+    RpcProxyPoolOptions pool;
+
+    /// The time it takes for an old latency measurement to lose most of its weight.
+    RpcProxy::Clock::duration decayTime = std::chrono::seconds( 10);
+
+    /// The number of consecutive failures after which a service is ejected.
+    unsigned maxFailures = 5;
+
+    /// How long an ejected service is left alone.
+    RpcProxy::Clock::duration ejectionTime = std::chrono::seconds( 10);
+
+    /// Options for calls of idempotent functions.
+    HedgingOptions hedging;
+};
+
+/**
+ * The state of one of the services of a BalancingRpcProxy, as reported by
+ * BalancingRpcProxy::status().
+ */
+struct RpcBackendStatus
+{
+    RpcAddress                  address;
+    std::size_t                 outstanding;    ///< calls in progress
+    std::chrono::microseconds   latency;        ///< moving average of the latency
+    unsigned                    failures;       ///< consecutive failures
+    bool                        ejected;
+};
+
+/// Counters of the calls of idempotent functions of a BalancingRpcProxy.
+struct HedgingMetrics
+{
+    std::uint64_t calls = 0;    ///< calls of idempotent functions
+    std::uint64_t hedged = 0;   ///< calls that were sent to a second service
+    std::uint64_t won = 0;      ///< hedged calls where the second service replied first
+};
+
+/**
+ * A thread-safe proxy that balances calls over a number of equivalent RPC
+ * services.
+ *
+ * A BalancingRpcProxy can be used wherever an RpcProxy can be used, in
+ * particular with CreateProxyFunction. It holds an RpcProxyPool for each
+ * service and chooses a service for every call with the "power of two
+ * choices" method: it picks two services at random and sends the call to
+ * the one with the lowest cost. The cost of a service is the number of calls
+ * in progress times a moving average of its latency. The average is
+ * peak-sensitive, so that a service that suddenly slows down is avoided
+ * right away, while it only gradually regains its share when it recovers.
+ * The average also decays while a service is not used, so that a service
+ * that was avoided is tried again. Services that have not been measured yet
+ * are assumed to have the mean latency of the others.
+ *
+ * A service that fails a number of calls in a row (timeouts, overload and
+ * connection errors, but not errors reported by the called function) is
+ * ejected for a while. If all services are ejected, calls are balanced over
+ * all of them anyway.
+ *
+ * Calls of idempotent functions can be hedged to cut the tail latency: if
+ * the service does not reply within a delay, the same call is sent to a
+ * second service and the first reply wins. The number of hedged calls is
+ * limited by a budget, so that a slow system is not swamped by duplicates.
+ * Use CreateIdempotentProxyFunction to create a function proxy that hedges.
+ */
+class BalancingRpcProxy
+{
+public:
+    typedef RpcProxy::Clock Clock;
+
+    /// Throws std::invalid_argument if there are no addresses.
+    BalancingRpcProxy(
+        const std::vector<RpcAddress> &addresses,
+        const BalancingRpcProxyOptions &options = BalancingRpcProxyOptions{})
+    : m_options( options), m_lifetime( std::make_shared<Lifetime>( this))
+    {
+        if (addresses.empty())
+        {
+            throw std::invalid_argument( "BalancingRpcProxy needs at least one service");
+        }
+        for (const auto &address : addresses)
+        {
+            m_backends.emplace_back( new Backend{ address});
+        }
+    }
+
+    /// Shut the connection pools down first, because the first attempts of hedged calls
+    /// may still be in progress, and those refer to their services. Streams that are
+    /// still open stop reporting to this proxy.
+    ~BalancingRpcProxy()
+    {
+        {
+            std::lock_guard<std::mutex> lock{ m_lifetime->mutex};
+            m_lifetime->proxy = nullptr;
+        }
+        for (auto &backend : m_backends) backend->pool.reset();
+    }
+
+    /**
+     * Call a regular function on one of the services and wait for its result.
+     *
+     * @see RpcProxy::call
+     */
+    Blob call( const std::string &name, const Blob &parameters, Clock::duration timeout = Clock::duration::zero())
+    {
+        Backend &backend = pick();
+        const auto start = Clock::now();
+        try
+        {
+            Blob result = pool( backend).call( name, parameters, timeout);
+            complete( backend, start, true);
+            return result;
+        }
+        catch (boost::system::system_error &)
+        {
+            complete( backend, start, false);
+            throw;
+        }
+        catch (...)
+        {
+            // the function reported an error, but the service itself did its job.
+            complete( backend, start, true);
+            throw;
+        }
+    }
+
+    /**
+     * Call a regular function that is idempotent, hedging the call if the reply takes long.
+     *
+     * The first reply wins. A hedge that loses is cancelled, but the first attempt is left
+     * to complete, so that its full latency is measured even when the hedge won; the service
+     * works on it anyway. If the first service fails before the hedge delay, the call is sent
+     * to the second service right away. A timeout applies to the call as a whole.
+     */
+    Blob call_idempotent( const std::string &name, const Blob &parameters, Clock::duration timeout = Clock::duration::zero())
+    {
+        const auto start = Clock::now();
+        auto hedge = std::make_shared<HedgedCall>();
+        std::unique_lock<std::mutex> lock{ hedge->mutex};
+
+        start_attempt( hedge, pick(), name, parameters, timeout);
+        const auto hedgeTime = start + hedge_delay();
+        hedge->arrived.wait_until( lock, hedgeTime, [&]{ return hedge->finished;});
+
+        // hedge if the first attempt is slow, or right away if it failed, but only while some
+        // of the timeout remains: a hedge without a timeout would wait without a deadline.
+        const bool failed = hedge->finished
+                && (hedge->error || std::get<1>( hedge->reply) == ReplyType::Overloaded);
+        const auto remaining = timeout == Clock::duration::zero() ? timeout : start + timeout - Clock::now();
+        if ((!hedge->finished || failed)
+            && (timeout == Clock::duration::zero() || remaining > Clock::duration::zero()))
+        {
+            Backend *second = spend_hedge( *hedge->attempts.front().backend);
+            if (second)
+            {
+                hedge->finished = false;
+                start_attempt( hedge, *second, name, parameters, remaining);
+            }
+        }
+        hedge->arrived.wait( lock, [&]{ return hedge->finished;});
+
+        // a losing hedge is not needed anymore.
+        for (auto &attempt : hedge->attempts)
+        {
+            if (attempt.completed || is_first( *hedge, attempt)) continue;
+            attempt.completed = true;
+            if (attempt.call) attempt.backend->pool->cancel( attempt.call);
+            abandon( *attempt.backend, attempt.start);
+        }
+        lock.unlock();
+
+        record_hedge( *hedge);
+        if (hedge->error) throw boost::system::system_error( hedge->error);
+        RpcProxy::check_error( hedge->reply);
+        return std::move( std::get<2>( hedge->reply));
+    }
+
+    /// Report the counters of calls of idempotent functions.
+    HedgingMetrics hedging_metrics() const
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        return m_hedgingMetrics;
+    }
+
+    /**
+     * Call a streaming function on one of the services.
+     *
+     * The stream counts as a call in progress until it has ended or until the generator
+     * is destroyed. Streams do not contribute to the latency average. The generator may
+     * outlive the proxy, see RpcProxyPool::open_stream.
+     *
+     * @see RpcProxy::open_stream
+     */
+    BlobGenerator open_stream( const std::string &name, const Blob &parameters, Clock::duration timeout = Clock::duration::zero())
+    {
+        Backend &backend = pick();
+        std::shared_ptr<StreamGuard> guard{ new StreamGuard{ m_lifetime, backend}};
+        try
+        {
+            auto values = std::make_shared<BlobGenerator>( pool( backend).open_stream( name, parameters, timeout));
+            return BlobGenerator{
+                [values, guard]( Blob &value)
+                {
+                    try
+                    {
+                        if ((*values)( value)) return true;
+                        guard->end( true);
+                        return false;
+                    }
+                    catch (boost::system::system_error &)
+                    {
+                        guard->end( false);
+                        throw;
+                    }
+                }
+            };
+        }
+        catch (boost::system::system_error &)
+        {
+            guard->end( false);
+            throw;
+        }
+    }
+
+    /// Report the state of each of the services.
+    std::vector<RpcBackendStatus> status() const
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        const auto now = Clock::now();
+        std::vector<RpcBackendStatus> result;
+        for (const auto &backend : m_backends)
+        {
+            result.push_back( RpcBackendStatus{
+                backend->address,
+                backend->outstanding,
+                std::chrono::microseconds( static_cast<std::int64_t>( current_latency( *backend, now))),
+                backend->failures,
+                backend->ejectedUntil > now});
+        }
+        return result;
+    }
+
+private:
+    /// One of the services that calls are balanced over.
+    struct Backend
+    {
+        explicit Backend( const RpcAddress &a) : address( a) {}
+
+        const RpcAddress                address;
+        std::once_flag                  created;
+        std::unique_ptr<RpcProxyPool>   pool;
+
+        // the following members are protected by the mutex of the BalancingRpcProxy.
+        std::size_t                     outstanding = 0;
+        double                          latency = 0;    ///< in microseconds
+        Clock::time_point               measured;       ///< time of the last latency measurement
+        unsigned                        failures = 0;
+        Clock::time_point               ejectedUntil;
+    };
+
+    /// Tells objects that may outlive the proxy, like the guard of a stream, whether the
+    /// proxy still exists. The proxy is set to null when its destruction starts.
+    struct Lifetime
+    {
+        explicit Lifetime( BalancingRpcProxy *p) : proxy( p) {}
+
+        std::mutex          mutex;
+        BalancingRpcProxy   *proxy;
+    };
+
+    /// Ends the administration of a stream, at the latest when the stream is destroyed.
+    /// A proxy that no longer exists needs no administration.
+    struct StreamGuard
+    {
+        StreamGuard( std::weak_ptr<Lifetime> l, Backend &b) : lifetime( l), backend( &b) {}
+
+        void end( bool success)
+        {
+            if (ended) return;
+            ended = true;
+
+            auto proxyLifetime = lifetime.lock();
+            if (!proxyLifetime) return;
+            std::lock_guard<std::mutex> lock{ proxyLifetime->mutex};
+            if (proxyLifetime->proxy) proxyLifetime->proxy->complete( *backend, Clock::time_point{}, success);
+        }
+
+        ~StreamGuard()
+        {
+            end( true);
+        }
+
+        std::weak_ptr<Lifetime> lifetime;
+        Backend                 *backend;   ///< owned by the proxy, so only valid while it exists
+        bool                    ended = false;
+    };
+
+    /// One of the (at most two) calls that together make up a hedged call.
+    struct Attempt
+    {
+        explicit Attempt( Backend &b) : backend( &b), start( Clock::now()) {}
+
+        Backend                         *backend;
+        Clock::time_point               start;
+        RpcProxyPool::AsyncCallPtr      call;
+        bool                            completed = false;
+    };
+
+    /// The state of a hedged call, which is shared with the reply handlers of its attempts.
+    struct HedgedCall
+    {
+        std::mutex                  mutex;
+        std::condition_variable     arrived;
+        std::deque<Attempt>         attempts;   ///< a deque, because handlers refer to its elements
+        bool                        finished = false;
+        bool                        hedgeWon = false;
+        boost::system::error_code   error;
+        RpcReply                    reply;
+    };
+    typedef std::shared_ptr<HedgedCall> HedgedCallPtr;
+
+    /**
+     * Send one attempt of a hedged call. This is called with the mutex of the hedged call locked.
+     *
+     * The hedged call finishes with the first reply, or with the last error if no service replies.
+     * Overload replies count as errors, so that the other service gets a chance.
+     */
+    void start_attempt(
+            const HedgedCallPtr &hedge,
+            Backend &backend,
+            const std::string &name,
+            const Blob &parameters,
+            Clock::duration timeout)
+    {
+        hedge->attempts.emplace_back( backend);
+        Attempt &attempt = hedge->attempts.back();
+        const bool isHedge = hedge->attempts.size() > 1;
+
+        try
+        {
+            // the first attempt may outlive the call, see call_idempotent().
+            attempt.call = pool( backend).async_call( name, parameters, timeout,
+                [this, hedge, &attempt, isHedge]( const boost::system::error_code &e, RpcReply &reply)
+                {
+                    std::lock_guard<std::mutex> lock{ hedge->mutex};
+                    finish_attempt( *hedge, attempt, isHedge, e, reply);
+                });
+        }
+        catch (boost::system::system_error &e)
+        {
+            RpcReply none;
+            finish_attempt( *hedge, attempt, isHedge, e.code(), none);
+        }
+    }
+
+    /// Administer the reply or error of an attempt. This is called with the mutex of the hedged call locked.
+    void finish_attempt(
+            HedgedCall &hedge,
+            Attempt &attempt,
+            bool isHedge,
+            const boost::system::error_code &e,
+            RpcReply &reply)
+    {
+        if (attempt.completed) return; // the attempt lost and was abandoned.
+        attempt.completed = true;
+
+        const bool success = !e && std::get<1>( reply) != ReplyType::Overloaded;
+        complete( *attempt.backend, attempt.start, success);
+        if (success && is_first( hedge, attempt)) record_latency( Clock::now() - attempt.start);
+        if (hedge.finished) return;
+
+        const bool last = std::all_of( hedge.attempts.begin(), hedge.attempts.end(),
+                []( const Attempt &a){ return a.completed;});
+        if (success || last)
+        {
+            hedge.finished = true;
+            hedge.hedgeWon = isHedge && success;
+            hedge.error = e;
+            hedge.reply = std::move( reply);
+            hedge.arrived.notify_one();
+        }
+    }
+
+    static bool is_first( const HedgedCall &hedge, const Attempt &attempt)
+    {
+        return &attempt == &hedge.attempts.front();
+    }
+
+    /**
+     * The time to wait for a reply before a call is hedged.
+     *
+     * This is a percentile of the latencies of the first attempts of the calls of idempotent
+     * functions in the current and in the previous measurement window. Those include the
+     * slow attempts that were hedged, so hedging does not lower its own delay.
+     */
+    Clock::duration hedge_delay() const
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        LatencyHistogram latencies = m_latencies[0];
+        latencies += m_latencies[1];
+        if (latencies.count() < minimumSamples) return m_options.hedging.initialDelay;
+
+        return latencies.percentile( m_options.hedging.percentile);
+    }
+
+    /**
+     * Decide whether a call may be hedged and, if so, choose the second service.
+     *
+     * Every call of an idempotent function adds a fraction of a token to the budget and
+     * every hedge takes a full token. The number of saved tokens is limited, so that the
+     * budget can absorb a burst of slow replies, but not an outage.
+     */
+    Backend *spend_hedge( const Backend &first)
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        if (m_hedgeTokens < 1) return nullptr;
+
+        const auto now = Clock::now();
+        const double neutral = neutral_latency( now);
+        Backend *best = nullptr;
+        for (auto &backend : m_backends)
+        {
+            if (backend.get() == &first || backend->ejectedUntil > now) continue;
+            if (!best || cheaper( *backend, *best, now, neutral)) best = backend.get();
+        }
+        if (!best) return nullptr;
+
+        m_hedgeTokens -= 1;
+        ++best->outstanding;
+        return best;
+    }
+
+    /// Count a finished call of an idempotent function.
+    void record_hedge( const HedgedCall &hedge)
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        ++m_hedgingMetrics.calls;
+        if (hedge.attempts.size() > 1) ++m_hedgingMetrics.hedged;
+        if (hedge.hedgeWon) ++m_hedgingMetrics.won;
+
+        m_hedgeTokens += m_options.hedging.budget;
+        if (m_hedgeTokens > maximumHedgeTokens) m_hedgeTokens = maximumHedgeTokens;
+    }
+
+    /// Record the latency of a successful first attempt of a call of an idempotent function.
+    void record_latency( Clock::duration latency)
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        if (m_latencies[0].count() >= windowSamples)
+        {
+            m_latencies[1] = m_latencies[0];
+            m_latencies[0] = LatencyHistogram{};
+        }
+        m_latencies[0].record( latency);
+    }
+
+    /// Return the connection pool of a service, creating it when it is first needed.
+    RpcProxyPool &pool( Backend &backend)
+    {
+        std::call_once( backend.created, [&]()
+            {
+                backend.pool.reset( new RpcProxyPool{ backend.address.host, backend.address.service, m_options.pool});
+            });
+        return *backend.pool;
+    }
+
+    /// Choose the service for the next call and count the call as outstanding.
+    Backend &pick()
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        const auto now = Clock::now();
+
+        std::vector<Backend *> candidates;
+        for (auto &backend : m_backends)
+        {
+            if (backend->ejectedUntil <= now) candidates.push_back( backend.get());
+        }
+        if (candidates.empty())
+        {
+            // everything is failing. Better to try something than to give up.
+            for (auto &backend : m_backends) candidates.push_back( backend.get());
+        }
+
+        Backend *best = candidates[ random_index( candidates.size())];
+        if (candidates.size() > 1)
+        {
+            // pick a second candidate that differs from the first.
+            auto index = random_index( candidates.size() - 1);
+            Backend *other = candidates[index] == best ? candidates.back() : candidates[index];
+            if (cheaper( *other, *best, now, neutral_latency( now))) best = other;
+        }
+
+        ++best->outstanding;
+        return *best;
+    }
+
+    /**
+     * Administer a call that was abandoned because another service replied first.
+     *
+     * The time that the call took so far is less than its latency, so it can only raise
+     * the latency average.
+     */
+    void abandon( Backend &backend, Clock::time_point start)
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        const auto now = Clock::now();
+        --backend.outstanding;
+
+        using std::chrono::duration;
+        using std::chrono::duration_cast;
+        const double elapsed = duration_cast<duration<double, std::micro>>( now - start).count();
+        if (elapsed > current_latency( backend, now))
+        {
+            backend.latency = elapsed;
+            backend.measured = now;
+        }
+    }
+
+    /// Return the latency average of a service, decayed by the time since it was last
+    /// measured, as if the service had replied instantly since then.
+    double current_latency( const Backend &backend, Clock::time_point now) const
+    {
+        using std::chrono::duration;
+        using std::chrono::duration_cast;
+        const double elapsed = duration_cast<duration<double>>( now - backend.measured).count();
+        const double decay = duration_cast<duration<double>>( m_options.decayTime).count();
+        return elapsed > 0 ? backend.latency * std::exp( -elapsed / decay) : backend.latency;
+    }
+
+    static bool measured( const Backend &backend)
+    {
+        return backend.measured != Clock::time_point{};
+    }
+
+    /// Return the latency to assume for services that have not been measured yet: the mean
+    /// of the services that have, so that a new or failing service is neither shunned nor
+    /// flooded.
+    double neutral_latency( Clock::time_point now) const
+    {
+        double sum = 0;
+        std::size_t count = 0;
+        for (const auto &backend : m_backends)
+        {
+            if (!measured( *backend)) continue;
+            sum += current_latency( *backend, now);
+            ++count;
+        }
+        return count ? sum / count : 0;
+    }
+
+    double cost( const Backend &backend, Clock::time_point now, double neutral) const
+    {
+        const double latency = measured( backend) ? current_latency( backend, now) : neutral;
+        return latency * (backend.outstanding + 1);
+    }
+
+    /// Return whether the first service is cheaper than the second. Services of the same
+    /// cost, for instance because their latencies are not known, are compared by the
+    /// number of calls in progress.
+    bool cheaper( const Backend &first, const Backend &second, Clock::time_point now, double neutral) const
+    {
+        const double firstCost = cost( first, now, neutral);
+        const double secondCost = cost( second, now, neutral);
+        if (firstCost != secondCost) return firstCost < secondCost;
+        return first.outstanding < second.outstanding;
+    }
+
+    std::size_t random_index( std::size_t size)
+    {
+        return std::uniform_int_distribution<std::size_t>{ 0, size - 1}( m_random);
+    }
+
+    /**
+     * Administer the end of a call.
+     *
+     * The latency average decays with the time since the previous measurement, but a
+     * measurement that is higher than the average replaces it immediately.
+     */
+    void complete( Backend &backend, Clock::time_point start, bool success)
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        const auto now = Clock::now();
+        --backend.outstanding;
+
+        if (!success)
+        {
+            if (++backend.failures >= m_options.maxFailures)
+            {
+                backend.ejectedUntil = now + m_options.ejectionTime;
+
+                // after the ejection, a single failure is enough to eject the service again.
+                backend.failures = m_options.maxFailures - 1;
+            }
+            return;
+        }
+
+        backend.failures = 0;
+        if (start == Clock::time_point{}) return;
+
+        using std::chrono::duration;
+        using std::chrono::duration_cast;
+        const double sample = duration_cast<duration<double, std::micro>>( now - start).count();
+        const double elapsed = duration_cast<duration<double>>( now - backend.measured).count();
+        const double decay = duration_cast<duration<double>>( m_options.decayTime).count();
+        const double weight = std::exp( -elapsed / decay);
+
+        // a peak is compared with the average as it was used for balancing, which has decayed
+        // since the previous measurement. Otherwise the weight applies that decay once.
+        const double average = current_latency( backend, now);
+        backend.latency = sample > average ? sample : backend.latency * weight + sample * (1 - weight);
+        backend.measured = now;
+    }
+
+    /// Latencies are measured in windows of this many calls.
+    static constexpr std::uint64_t windowSamples = 1000;
+
+    /// The number of measured latencies below which the initial hedge delay is used.
+    static constexpr std::uint64_t minimumSamples = 20;
+
+    /// The maximum number of hedges that can be saved up.
+    static constexpr double maximumHedgeTokens = 10;
+
+    const BalancingRpcProxyOptions          m_options;
+    const std::shared_ptr<Lifetime>         m_lifetime;
+    mutable std::mutex                      m_mutex;
+    std::minstd_rand                        m_random;
+
+    LatencyHistogram                        m_latencies[2]; ///< the current and the previous window
+    double                                  m_hedgeTokens = maximumHedgeTokens;
+    HedgingMetrics                          m_hedgingMetrics;
+
+    /// The services come last, so that their pools are shut down before the rest of the state is destroyed.
+    std::vector<std::unique_ptr<Backend>>   m_backends;
+};
+
+/**
+ * A function proxy for an idempotent function, which hedges its calls.
+ *
+ * @see BalancingRpcProxy::call_idempotent
+ */
+class IdempotentFunctionProxy : public FunctionProxy<BalancingRpcProxy>
+{
+public:
+    using FunctionProxy<BalancingRpcProxy>::FunctionProxy;
+
+    Blob Call( const Blob &parameters) override
+    {
+        return m_rpcProxy.call_idempotent( m_functionName, parameters, m_timeout);
+    }
+};
+
+/**
+ * Create a function proxy for an idempotent function from an existing function
+ * prototype.
+ *
+ * Calling an idempotent function more than once has the same effect as calling
+ * it once, which means that its calls can safely be hedged.
+ *
+ * @see CreateProxyFunction
+ */
+template<typename ReturnType, typename... Parameters>
+BinaryFunctionMarshaller< ReturnType (Parameters...)> CreateIdempotentProxyFunction(
+        ReturnType (*)( Parameters...),
+        BalancingRpcProxy &rpcProxy,
+        const std::string &functionName,
+        RpcProxy::Clock::duration timeout = RpcProxy::Clock::duration::zero()
+    )
+{
+    auto proxy = std::make_shared<IdempotentFunctionProxy>( functionName, rpcProxy, timeout);
+    return BinaryFunctionMarshaller< ReturnType (Parameters...)>{proxy};
+}
+
+/**
+ * Create a function proxy for an idempotent function from an explicitly specified
+ * function prototype.
+ *
+ * @see CreateIdempotentProxyFunction
+ */
+template< typename FunctionType>
+BinaryFunctionMarshaller< FunctionType> CreateIdempotentProxyFunction(
+    BalancingRpcProxy &rpcProxy,
+    const std::string &functionName,
+    RpcProxy::Clock::duration timeout = RpcProxy::Clock::duration::zero()
+    )
+{
+    auto proxy = std::make_shared<IdempotentFunctionProxy>( functionName, rpcProxy, timeout);
+    return BinaryFunctionMarshaller< FunctionType>{proxy};
+}
+
+#endif /* BALANCING_RPC_PROXY_HPP_ */
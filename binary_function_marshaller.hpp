@@ -15,12 +15,56 @@
 #include <boost/iostreams/stream.hpp>
 #include <iostream>
 #include <memory>
+#include <type_traits>
 #include <vector>
 
 #include "function_interface.hpp"
+#include "parameter_view.hpp"
 #include "tuple_serialization.hpp"
 
 
+/// The type in which a marshaller takes a parameter: a parameter is only serialized, so
+/// it never needs to be copied.
+template<typename Parameter>
+using MarshalledParameter = const typename std::remove_reference<Parameter>::type &;
+
+/**
+ * Serialize function arguments into a parameter blob, in the form that a
+ * BinaryFunctionWrapper expects.
+ *
+ * The arguments are serialized one after the other, without copying them
+ * into a tuple first. The same blob can be sent to any number of services.
+ */
+template<typename... Parameters>
+Blob MarshalParameters( const Parameters &... pars)
+{
+    using namespace boost::iostreams;
+    using namespace boost::archive;
+
+    Blob parameterBlob;
+    stream<back_insert_device<Blob>> parameterStream{parameterBlob};
+    binary_oarchive parameterArchive{ parameterStream};
+
+    (void)(int[]){ 0, ((parameterArchive << pars), 0)...};
+
+    parameterStream.flush();
+    return parameterBlob;
+}
+
+/**
+ * De-serialize a result value from a blob that was produced by a
+ * BinaryFunctionWrapper.
+ */
+template<typename ValueType>
+void UnmarshalValue( const Blob &blob, ValueType &value)
+{
+    using namespace boost::iostreams;
+    using namespace boost::archive;
+
+    stream<array_source> resultStream{ &blob.front(), blob.size()};
+    binary_iarchive resultArchive{ resultStream};
+    resultArchive >> value;
+}
 
 /**
  * Object type that acts as a functor and that:
@@ -42,34 +86,53 @@ public:
     {
     }
 
-    ReturnType operator()( Parameters... pars)
+    ReturnType operator()( MarshalledParameter<Parameters>... pars)
     {
-        using namespace boost::iostreams;
-        using namespace boost::archive;
-
-        auto parameterTuple = std::make_tuple( pars...);
-        Blob parameterBlob;
-        stream<back_insert_device<Blob>> parameterStream{parameterBlob};
-        binary_oarchive parameterArchive{ parameterStream};
-
-        parameterArchive << parameterTuple;
-
-        parameterStream.flush();
-
-        Blob resultBlob = m_function->Call( parameterBlob);
-
-        stream<array_source> resultStream{ &resultBlob.front(), resultBlob.size()};
-        binary_iarchive resultArchive{ resultStream};
+        Blob resultBlob = m_function->Call( MarshalParameters( pars...));
 
         ReturnType result;
-        resultArchive >> result;
-
+        UnmarshalValue( resultBlob, result);
         return result;
     }
 private:
     std::shared_ptr<FunctionInterface> m_function;
 };
 
+/**
+ * Marshaller for functions that return a Generator.
+ *
+ * Calling this functor serializes the parameters and calls a
+ * StreamFunctionInterface instance. The Generator that is returned
+ * de-serializes the values one by one, as they are requested.
+ */
+template<typename ValueType, typename... Parameters>
+class BinaryFunctionMarshaller< Generator<ValueType> (Parameters...)>
+{
+public:
+    BinaryFunctionMarshaller( std::shared_ptr<StreamFunctionInterface> function)
+            :m_function{function}
+    {
+    }
+
+    Generator<ValueType> operator()( MarshalledParameter<Parameters>... pars)
+    {
+        auto resultBlobs = m_function->CallStream( MarshalParameters( pars...));
+
+        return Generator<ValueType>{
+            [resultBlobs]( ValueType &value) mutable
+            {
+                Blob resultBlob;
+                if (!resultBlobs( resultBlob)) return false;
+
+                UnmarshalValue( resultBlob, value);
+                return true;
+            }
+        };
+    }
+private:
+    std::shared_ptr<StreamFunctionInterface> m_function;
+};
+
 /**
  * Create a functor object that has the same prototype as the function
  * given as the first argument and that will Marshal function arguments
@@ -87,6 +150,20 @@ BinaryFunctionMarshaller< ReturnType (Parameters...)> Marshal(
     return BinaryFunctionMarshaller< ReturnType (Parameters...)>{wrappedFunction};
 }
 
+/**
+ * Create a functor object for a function that returns a Generator.
+ *
+ * @see Marshal
+ */
+template<typename ValueType, typename... Parameters>
+BinaryFunctionMarshaller< Generator<ValueType> (Parameters...)> Marshal(
+        Generator<ValueType> (*)( Parameters...),
+        const std::shared_ptr<StreamFunctionInterface> wrappedFunction
+    )
+{
+    return BinaryFunctionMarshaller< Generator<ValueType> (Parameters...)>{wrappedFunction};
+}
+
 
 
 #endif /* BINARY_FUNCTION_MARSHALLER_HPP_ */
@@ -13,13 +13,15 @@
 #include <boost/iostreams/device/array.hpp>
 #include <boost/iostreams/device/back_inserter.hpp>
 #include <boost/iostreams/stream.hpp>
-#include <functional>
+#include <memory>
 #include <tuple>
 #include <type_traits>
 #include <vector>
 
 #include "function_interface.hpp"
 #include "index_sequence.hpp"
+#include "parameter_view.hpp"
+#include "tuple_serialization.hpp"
 
 
 /**
@@ -27,13 +29,21 @@
  * FunctionInterface interface.
  *
  * When called, this wrapper will de-serialize the argument Blob, then call
- * the wrapped function and then serialize the return value into a Blob.
+ * the wrapped function and then serialize the return value into a Blob. The
+ * arguments are de-serialized one after the other, as MarshalParameters
+ * serializes them.
+ *
+ * The wrapper is templated on the type of the callable object, so that
+ * calls of a function object or lambda can be inlined. The de-serialized
+ * arguments are moved into parameters that are taken by value.
+ *
+ * Parameters of type StringView or BlobView point into the argument Blob,
+ * instead of being copied out of it.
  */
-template< typename ReturnType, typename... Parameters>
+template< typename Function, typename ReturnType, typename... Parameters>
 class BinaryFunctionWrapper : public FunctionInterface
 {
 public:
-    using Function = std::function< ReturnType( Parameters...)>;
     using ParameterTuple =
             std::tuple<
                 typename std::remove_const<
@@ -41,8 +51,8 @@ public:
                     >::type...
                 >;
 
-    BinaryFunctionWrapper( Function f)
-    :m_function{f}
+    explicit BinaryFunctionWrapper( Function f)
+    :m_function{ std::move( f)}
     {
     }
 
@@ -54,15 +64,18 @@ public:
 
         ParameterTuple pars;
         stream<array_source> parameterStream{ &parameters.front(), parameters.size()};
-        binary_iarchive parameterArchive{ parameterStream};
-        parameterArchive >> pars;
+        ParameterArchive parameterArchive{ parameterStream, parameters};
+        SerializeTuple( parameterArchive, pars, MakeIndexSequence_t<sizeof...(Parameters)>{});
 
         Blob resultBlob;
-        stream<back_insert_device<Blob>> resultStream{ resultBlob};
-        binary_oarchive resultArchive{resultStream};
-        auto res = Invoke( m_function, pars);
+        {
+            stream<back_insert_device<Blob>> resultStream{ resultBlob};
+            binary_oarchive resultArchive{resultStream};
+            const ReturnType res = Invoke( pars, MakeIndexSequence_t<sizeof...(Parameters)>{});
 
-        resultArchive << res;
+            resultArchive << res;
+            resultStream.flush();
+        }
 
         return resultBlob;
     }
@@ -70,37 +83,208 @@ public:
     virtual ~BinaryFunctionWrapper() {}
 
 private:
-    template< typename FunctionType, typename TupleType, size_t... Indexes>
-    static ReturnType Invoke( FunctionType f, TupleType &tuple, IndexSequence<Indexes...>)
+    template< size_t... Indexes>
+    ReturnType Invoke( ParameterTuple &tuple, IndexSequence<Indexes...>)
     {
-        return f( std::get<Indexes>(tuple)...);
+        return m_function( std::forward<Parameters>( std::get<Indexes>(tuple))...);
     }
 
-    template< typename FunctionType, typename... Pars>
-    static ReturnType Invoke( FunctionType f, std::tuple<Pars...> &parameters)
+    Function m_function;
+};
+
+/**
+ * Wrapper object that wraps a callable object that returns a Generator and
+ * implements the StreamFunctionInterface interface.
+ *
+ * When called, this wrapper will de-serialize the argument Blob and call the
+ * wrapped function. The resulting generator is not run immediately: every
+ * time the returned BlobGenerator is asked for its next Blob, the next value
+ * is obtained from the wrapped generator and serialized.
+ */
+template< typename Function, typename ValueType, typename... Parameters>
+class BinaryGeneratorWrapper : public StreamFunctionInterface
+{
+public:
+    using ParameterTuple =
+            std::tuple<
+                typename std::remove_const<
+                        typename std::remove_reference<Parameters>::type
+                    >::type...
+                >;
+
+    static_assert( !HasParameterView<Parameters...>::value,
+        "a generator runs after the call has returned, so it can not take parameter views");
+
+    explicit BinaryGeneratorWrapper( Function f)
+    :m_function{ std::move( f)}
     {
-        return Invoke( f, parameters, MakeIndexSequence_t<sizeof...(Pars)>{});
+    }
+
+    BlobGenerator CallStream( const Blob &parameters) override
+    {
+        using namespace boost::iostreams;
+        using namespace boost::archive;
+
+        ParameterTuple pars;
+        stream<array_source> parameterStream{ &parameters.front(), parameters.size()};
+        binary_iarchive parameterArchive{ parameterStream};
+        SerializeTuple( parameterArchive, pars, MakeIndexSequence_t<sizeof...(Parameters)>{});
+
+        auto values = Invoke( pars, MakeIndexSequence_t<sizeof...(Parameters)>{});
+
+        return BlobGenerator{
+            [values]( Blob &resultBlob) mutable
+            {
+                ValueType value;
+                if (!values( value)) return false;
+
+                resultBlob.clear();
+                stream<back_insert_device<Blob>> resultStream{ resultBlob};
+                binary_oarchive resultArchive{resultStream};
+                resultArchive << value;
+                resultStream.flush();
+                return true;
+            }
+        };
+    }
+
+    virtual ~BinaryGeneratorWrapper() {}
+
+private:
+    template< size_t... Indexes>
+    Generator<ValueType> Invoke( ParameterTuple &tuple, IndexSequence<Indexes...>)
+    {
+        return m_function( std::forward<Parameters>( std::get<Indexes>(tuple))...);
     }
 
     Function m_function;
 };
 
-//template< typename ReturnType, typename... Parameters>
-//std::shared_ptr<FunctionInterface> Wrap( ReturnType (&function)( Parameters... pars))
-//{
-//    return std::make_shared<BinaryFunctionWrapper<ReturnType, Parameters...>>(function);
-//}
+/**
+ * Selects the wrapper for a callable object of a given signature: a
+ * BinaryGeneratorWrapper for functions that return a Generator and a
+ * BinaryFunctionWrapper for all other functions.
+ */
+template< typename Function, typename Signature>
+struct WrapperOf
+{
+};
 
+template< typename Function, typename ReturnType, typename... Parameters>
+struct WrapperOf< Function, ReturnType (Parameters...)>
+{
+    using Interface = FunctionInterface;
+    using Wrapper = BinaryFunctionWrapper<Function, ReturnType, Parameters...>;
+};
+
+template< typename Function, typename ValueType, typename... Parameters>
+struct WrapperOf< Function, Generator<ValueType> (Parameters...)>
+{
+    using Interface = StreamFunctionInterface;
+    using Wrapper = BinaryGeneratorWrapper<Function, ValueType, Parameters...>;
+};
+
+/// The signature of the call operator of a function object, like a lambda.
+template< typename CallOperator>
+struct CallOperatorSignature
+{
+};
+
+template< typename Class, typename ReturnType, typename... Parameters>
+struct CallOperatorSignature< ReturnType (Class::*)( Parameters...)>
+{
+    using type = ReturnType (Parameters...);
+};
+
+template< typename Class, typename ReturnType, typename... Parameters>
+struct CallOperatorSignature< ReturnType (Class::*)( Parameters...) const>
+{
+    using type = ReturnType (Parameters...);
+};
+
+/**
+ * Function object that calls a member function on an object that it shares
+ * ownership of.
+ */
+template< typename ObjectType, typename MemberFunction, typename ReturnType>
+class BoundMemberFunction
+{
+public:
+    BoundMemberFunction( std::shared_ptr<ObjectType> object, MemberFunction function)
+    : m_object{ std::move( object)}, m_function{ function}
+    {
+    }
+
+    template< typename... Arguments>
+    ReturnType operator()( Arguments&&... arguments)
+    {
+        return ((*m_object).*m_function)( std::forward<Arguments>( arguments)...);
+    }
+
+private:
+    std::shared_ptr<ObjectType> m_object;
+    MemberFunction              m_function;
+};
+
+/**
+ * Create a wrapper for a callable object with the given signature.
+ *
+ * The result is a FunctionInterface or, for functions that return a Generator,
+ * a StreamFunctionInterface.
+ */
+template< typename Signature, typename Function>
+std::shared_ptr<typename WrapperOf<Function, Signature>::Interface> WrapCallable( Function function)
+{
+    return std::make_shared<typename WrapperOf<Function, Signature>::Wrapper>( std::move( function));
+}
+
+/**
+ * Wrap a free function.
+ *
+ * Functions that produce their results as a Generator are wrapped in a
+ * StreamFunctionInterface. An RpcService will send each generated value to
+ * the client as soon as it has been produced.
+ */
 template< typename ReturnType, typename... Parameters>
-std::shared_ptr<FunctionInterface> Wrap( ReturnType (*function)( Parameters... pars))
+auto Wrap( ReturnType (*function)( Parameters... pars))
+    -> decltype( WrapCallable<ReturnType (Parameters...)>( function))
+{
+    return WrapCallable<ReturnType (Parameters...)>( function);
+}
+
+/**
+ * Wrap a function object, like a lambda, possibly with captures. The
+ * signature is taken from its call operator, which can therefore not be a
+ * template or be overloaded.
+ */
+template< typename Function>
+auto Wrap( Function function)
+    -> decltype( WrapCallable<typename CallOperatorSignature<decltype( &Function::operator())>::type>( function))
+{
+    using Signature = typename CallOperatorSignature<decltype( &Function::operator())>::type;
+    return WrapCallable<Signature>( std::move( function));
+}
+
+/**
+ * Wrap a member function, which will be called on the given object. The
+ * wrapper shares ownership of the object.
+ */
+template< typename ObjectType, typename ReturnType, typename... Parameters>
+auto Wrap( const std::shared_ptr<ObjectType> &object, ReturnType (ObjectType::*function)( Parameters... pars))
+    -> decltype( WrapCallable<ReturnType (Parameters...)>(
+            BoundMemberFunction<ObjectType, ReturnType (ObjectType::*)( Parameters...), ReturnType>{ object, function}))
 {
-    return std::make_shared<BinaryFunctionWrapper<ReturnType, Parameters...>>(function);
+    using Bound = BoundMemberFunction<ObjectType, ReturnType (ObjectType::*)( Parameters...), ReturnType>;
+    return WrapCallable<ReturnType (Parameters...)>( Bound{ object, function});
 }
 
 template< typename ObjectType, typename ReturnType, typename... Parameters>
-std::shared_ptr<FunctionInterface> Wrap( std::shared_ptr<ObjectType> &object, ReturnType (ObjectType::*function)( Parameters... pars))
+auto Wrap( const std::shared_ptr<ObjectType> &object, ReturnType (ObjectType::*function)( Parameters... pars) const)
+    -> decltype( WrapCallable<ReturnType (Parameters...)>(
+            BoundMemberFunction<ObjectType, ReturnType (ObjectType::*)( Parameters...) const, ReturnType>{ object, function}))
 {
-    return std::make_shared<BinaryFunctionWrapper<ReturnType, Parameters...>>(function);
+    using Bound = BoundMemberFunction<ObjectType, ReturnType (ObjectType::*)( Parameters...) const, ReturnType>;
+    return WrapCallable<ReturnType (Parameters...)>( Bound{ object, function});
 }
 
 #endif /* BINARY_FUNCTION_WRAPPER_HPP_ */
@@ -0,0 +1,162 @@
+//
+//  Copyright (C) 2017 Danny Havenith
+//
+//  Distributed under the Boost Software License, Version 1.0. (See
+//  accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt)
+//
+#ifndef BUFFER_POOL_HPP_
+#define BUFFER_POOL_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/**
+ * Memory that is used by the connections of a BufferPool.
+ */
+struct ConnectionMemory
+{
+    std::size_t connections = 0;        ///< connections that use the pool
+    std::size_t connectionBytes = 0;    ///< bytes held by those connections: the connection objects, their receive buffers and their queued frames
+    std::size_t pooledBytes = 0;        ///< bytes in buffers that are waiting in the pool to be borrowed
+
+    std::size_t bytes_per_connection() const
+    {
+        return connections ? connectionBytes / connections : 0;
+    }
+};
+
+/**
+ * A pool of receive buffers that is shared by connections.
+ *
+ * A connection that has no partially received message holds no buffer at
+ * all. It borrows one from the pool when data arrives and gives it back as
+ * soon as it has consumed all received messages, so the memory for buffers
+ * is proportional to the number of busy connections, not to the total
+ * number of connections.
+ *
+ * All buffers in the pool have the same size. A connection that has to
+ * receive a larger message grows its buffer, and that buffer is released
+ * instead of being pooled when it is given back.
+ *
+ * The pool also keeps track of the memory that its connections use. It can
+ * be used from any number of threads.
+ */
+class BufferPool
+{
+public:
+    typedef std::vector<char> Buffer;
+
+    explicit BufferPool( std::size_t bufferSize = 4096, std::size_t maxPooled = 256)
+    : m_bufferSize( bufferSize), m_maxPooled( maxPooled)
+    {
+    }
+
+    BufferPool( const BufferPool &) = delete;
+    BufferPool &operator=( const BufferPool &) = delete;
+
+    /// The pool that connections use if they are not given one.
+    static std::shared_ptr<BufferPool> shared()
+    {
+        static std::shared_ptr<BufferPool> pool{ new BufferPool};
+        return pool;
+    }
+
+    /// The size of the buffers in the pool.
+    std::size_t buffer_size() const
+    {
+        return m_bufferSize;
+    }
+
+    /// Borrow a buffer of buffer_size() bytes.
+    Buffer borrow()
+    {
+        Buffer buffer;
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex};
+            if (!m_pooled.empty())
+            {
+                buffer = std::move( m_pooled.back());
+                m_pooled.pop_back();
+            }
+        }
+
+        if (buffer.capacity())
+        {
+            m_pooledBytes -= buffer.capacity();
+        }
+        buffer.resize( m_bufferSize);
+        m_connectionBytes += buffer.capacity();
+        return buffer;
+    }
+
+    /// Return a borrowed buffer. It is kept for reuse only if it has the standard size.
+    void give_back( Buffer &buffer)
+    {
+        if (buffer.capacity() == 0) return;
+
+        m_connectionBytes -= buffer.capacity();
+        if (buffer.capacity() == m_bufferSize)
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex};
+            if (m_pooled.size() < m_maxPooled)
+            {
+                m_pooledBytes += buffer.capacity();
+                m_pooled.push_back( std::move( buffer));
+                buffer = Buffer{};
+                return;
+            }
+        }
+        Buffer{}.swap( buffer);
+    }
+
+    /// Account for a connection, which holds the given number of bytes by itself.
+    void add_connection( std::size_t bytes)
+    {
+        ++m_connections;
+        m_connectionBytes += bytes;
+    }
+
+    void remove_connection( std::size_t bytes)
+    {
+        --m_connections;
+        m_connectionBytes -= bytes;
+    }
+
+    /// Account for other memory that a connection holds, like queued frames.
+    void add_bytes( std::size_t bytes)
+    {
+        m_connectionBytes += bytes;
+    }
+
+    void remove_bytes( std::size_t bytes)
+    {
+        m_connectionBytes -= bytes;
+    }
+
+    ConnectionMemory memory() const
+    {
+        ConnectionMemory result;
+        result.connections = m_connections;
+        result.connectionBytes = m_connectionBytes;
+        result.pooledBytes = m_pooledBytes;
+        return result;
+    }
+
+private:
+    const std::size_t           m_bufferSize;
+    const std::size_t           m_maxPooled;
+
+    std::mutex                  m_mutex;
+    std::vector<Buffer>         m_pooled;
+
+    std::atomic<std::size_t>    m_connections{ 0};
+    std::atomic<std::size_t>    m_connectionBytes{ 0};
+    std::atomic<std::size_t>    m_pooledBytes{ 0};
+};
+
+#endif /* BUFFER_POOL_HPP_ */
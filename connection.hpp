@@ -27,10 +27,26 @@
 #include <boost/iostreams/device/back_inserter.hpp>
 #include <boost/iostreams/stream.hpp>
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <functional>
 #include <iomanip>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <streambuf>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include "buffer_pool.hpp"
+#include "io_uring_transport.hpp"
+#include "low_latency.hpp"
+#include "traffic_capture.hpp"
+
 
 /// The connection class provides serialization primitives on top of a socket.
 /**
@@ -38,16 +54,51 @@
  * @li An 8-byte header containing the length of the serialized data in
  * hexadecimal.
  * @li The serialized data.
+ *
+ * Outbound messages are serialized together with their header into a single
+ * frame and queued until they have been written. A message may end with the
+ * bytes of a shared blob, which are then written from that blob instead. Frames that are queued while
+ * a write is in progress are written together, with a single gather write.
+ * Asynchronous writes may be started from any thread, also while the io_service
+ * runs on several threads. Reads must not overlap each other.
+ *
+ * Inbound bytes are received into a buffer, so that in most cases a single
+ * receive operation suffices to read a message, however small or large.
+ *
+ * An idle connection holds no receive buffer. It waits until the socket is
+ * readable, borrows a buffer from a BufferPool to receive into, and gives the
+ * buffer back as soon as all received messages have been consumed.
+ *
+ * By default, the connection sends and receives with the reactor of its io_service.
+ * With Transport::IoUring, the IoUringTransport of the io_service does that instead.
+ * Synchronous reads other than try_read() use the socket directly, so they must not
+ * be used with that transport.
  */
 class connection
 {
 public:
     typedef std::vector<char> Blob;
 
-    /// Constructor.
-    connection(boost::asio::io_service& io_service)
-    : socket_(io_service)
+    /// Constructor. The connection borrows its receive buffers from the given pool,
+    /// which also keeps track of the memory that the connection uses.
+    connection(boost::asio::io_service& io_service,
+        std::shared_ptr<BufferPool> buffers = BufferPool::shared())
+    : connection(io_service, std::move(buffers), sizeof(connection))
+    {
+    }
+
+    connection(const connection&) = delete;
+    connection& operator=(const connection&) = delete;
+
+    ~connection()
     {
+        if (uring_)
+        {
+            uring_->remove_receiver(receiver_);
+        }
+        buffers_->give_back(inbound_buffer_);
+        buffers_->remove_bytes(outbound_bytes_);
+        buffers_->remove_connection(object_size_);
     }
 
     /// Get the underlying socket. Used for making a connection or for accepting
@@ -57,87 +108,173 @@ public:
         return socket_;
     }
 
-    /// Asynchronously write a data structure to the socket.
-    template <typename T, typename Handler>
-    void async_write(const T& t, Handler handler)
+    /// Apply socket options to the connected socket.
+    void set_options(const SocketOptions& options)
     {
-        using namespace boost::iostreams;
-        using namespace boost::archive;
+        ApplySocketOptions(socket_, options);
+        quick_ack_ = options.quickAck;
+        if (quick_ack_)
+        {
+            RenewQuickAck(socket_);
+        }
+    }
 
-        // Serialize the data first so we know how large it is.
-        outbound_data_.clear();
-        stream<back_insert_device<Blob>> dataStream{ outbound_data_};
-        binary_oarchive archive{ dataStream};
+    /// Send and receive with the given transport from now on. This must be called on a
+    /// connected socket, before any asynchronous operation. Returns false, and keeps the
+    /// current transport, if the requested one is not available. The options of io_uring
+    /// are used if this is the first connection of the io_service that uses it.
+    bool set_transport(Transport transport, const IoUringOptions& options = IoUringOptions{})
+    {
+        if (transport == Transport::IoUring && !uring_)
+        {
+            uring_ = IoUringTransport::of(socket_.get_io_service(), options);
+            if (uring_)
+            {
+                receiver_ = uring_->add_receiver(socket_.native_handle());
+            }
+        }
+        return transport == this->transport();
+    }
 
-        archive << t;
+    /// The transport that this connection sends and receives with.
+    Transport transport() const
+    {
+        return uring_ ? Transport::IoUring : Transport::Asio;
+    }
 
-        dataStream.flush();
-        // Format the header.
-        std::ostringstream header_stream;
-        header_stream << std::setw(header_length)
-                      << std::hex << outbound_data_.size();
-        if (!header_stream || header_stream.str().size() != header_length)
+    /// Close the socket. Asynchronous operations that are in progress complete with an error.
+    void close()
+    {
+        if (uring_)
+        {
+            uring_->close_receiver(receiver_);
+        }
+        boost::system::error_code ignored;
+        socket_.close(ignored);
+    }
+
+    /// Record every frame that this connection receives in the given capture, for
+    /// as long as the capture is active.
+    void set_capture(std::shared_ptr<TrafficCapture> capture)
+    {
+        capture_ = std::move(capture);
+        capture_id_ = capture_ ? capture_->new_connection() : 0;
+    }
+
+    /// Asynchronously write a data structure to the socket.
+    /**
+     * Messages are queued, so it is safe to start a new write while earlier
+     * writes are still in progress. Messages are sent in the order in which
+     * they were queued and the handler is called once the message has been
+     * written.
+     */
+    template <typename T, typename Handler>
+    void async_write(const T& t, Handler handler)
+    {
+        Blob frame;
+        if (!make_frame( t, frame))
         {
             // Something went wrong, inform the caller.
             boost::system::error_code error(boost::asio::error::invalid_argument);
-            socket_.get_io_service().post(boost::bind(handler, error));
+            socket_.get_io_service().post(boost::bind<void>(handler, error));
             return;
         }
-        outbound_header_ = header_stream.str();
 
-        // Write the serialized data to the socket. We use "gather-write" to send
-        // both the header and the data in a single write operation.
-        std::vector<boost::asio::const_buffer> buffers;
-        buffers.push_back(boost::asio::buffer(outbound_header_));
-        buffers.push_back(boost::asio::buffer(outbound_data_));
-        boost::asio::async_write(socket_, buffers, handler);
+        enqueue( OutboundMessage{ std::move( frame), nullptr, handler});
     }
 
-    template <typename T>
-    void write( const T& t)
+    /// Asynchronously write a data structure whose serialized data ends with the
+    /// contents of a shared blob, like an RpcMessage ends with its parameters.
+    /**
+     * The bytes of the blob are not copied into the frame, but written from the
+     * blob itself, which is kept alive until the write has finished. This way the
+     * same parameters can be sent over many connections, while only the rest of
+     * the message is serialized for each of them.
+     */
+    template <typename T, typename Handler>
+    void async_write(const T& t, std::shared_ptr<const Blob> tail, Handler handler)
     {
-        using namespace boost::iostreams;
-         using namespace boost::archive;
-
-         // Serialize the data first so we know how large it is.
-         outbound_data_.clear();
-         stream<back_insert_device<Blob>> dataStream{ outbound_data_};
-         binary_oarchive archive{ dataStream};
+        Blob frame;
+        if (!make_frame( t, frame, tail))
+        {
+            boost::system::error_code error(boost::asio::error::invalid_argument);
+            socket_.get_io_service().post(boost::bind<void>(handler, error));
+            return;
+        }
 
-         archive << t;
-         dataStream.flush();
+        enqueue( OutboundMessage{ std::move( frame), std::move( tail), handler});
+    }
 
-         // Format the header.
-         std::ostringstream header_stream;
-         header_stream << std::setw(header_length)
-                       << std::hex << outbound_data_.size();
+    /// The number of bytes that have been queued by async_write, but that have
+    /// not been completely written yet.
+    std::size_t outbound_bytes() const
+    {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        return outbound_bytes_;
+    }
 
-         if (!header_stream || header_stream.str().size() != header_length)
+    /// Write a data structure to the socket synchronously. This should not be
+    /// mixed with asynchronous writes that are still in progress.
+    template <typename T>
+    void write( const T& t)
+    {
+         Blob frame;
+         if (!make_frame( t, frame))
          {
              throw boost::system::error_code{ boost::asio::error::invalid_argument};
          }
-         outbound_header_ = header_stream.str();
-
-         // Write the serialized data to the socket. We use "gather-write" to send
-         // both the header and the data in a single write operation.
-         std::vector<boost::asio::const_buffer> buffers;
-         buffers.push_back(boost::asio::buffer(outbound_header_));
-         buffers.push_back(boost::asio::buffer(outbound_data_));
-         boost::asio::write(socket_, buffers);
+         boost::asio::write(socket_, boost::asio::buffer( frame));
     }
 
     /// Asynchronously read a data structure from the socket.
+    /**
+     * Received bytes are buffered, so that a single receive operation can pick up
+     * the header and data of a message, or even several messages at once. If a
+     * complete message has been buffered already, it is delivered without reading
+     * from the socket, but the handler is still called from within the io_service.
+     * If nothing has been buffered, this waits for the socket to become readable
+     * without holding a receive buffer.
+     */
     template <typename T, typename Handler>
     void async_read(Handler handler)
     {
-        // Issue a read operation to read exactly the number of bytes in a header.
         void (connection::*f)(
                 const boost::system::error_code&,
+                std::size_t,
                 boost::tuple<Handler>)
-                = &connection::handle_read_header<T, Handler>;
-        boost::asio::async_read(socket_, boost::asio::buffer(inbound_header_),
+                = &connection::handle_read_some<T, Handler>;
+
+        std::size_t data_size = 0;
+        if (buffered_frame( data_size) != frame_state::incomplete)
+        {
+            socket_.get_io_service().post(
+                    boost::bind(f, this, boost::system::error_code{}, 0, boost::make_tuple(handler)));
+            return;
+        }
+
+        if (uring_)
+        {
+            receive_from_ring<T>(handler, false);
+            return;
+        }
+
+        if (inbound_begin_ == inbound_end_)
+        {
+            void (connection::*r)(
+                    const boost::system::error_code&,
+                    boost::tuple<Handler>)
+                    = &connection::handle_readable<T, Handler>;
+            socket_.async_read_some(boost::asio::null_buffers(),
+                    boost::bind(r,
+                            this, boost::asio::placeholders::error,
+                            boost::make_tuple(handler)));
+            return;
+        }
+
+        socket_.async_read_some(receive_space( data_size),
                 boost::bind(f,
                         this, boost::asio::placeholders::error,
+                        boost::asio::placeholders::bytes_transferred,
                         boost::make_tuple(handler)));
     }
 
@@ -145,120 +282,658 @@ public:
     template< typename T>
     T read()
     {
-    	T result;
-        using namespace boost::iostreams;
-        using namespace boost::archive;
-    	boost::asio::read( socket_, boost::asio::buffer( inbound_header_));
-        std::istringstream is(std::string(inbound_header_, header_length));
-        std::size_t inbound_data_size = 0;
-        if (!(is >> std::hex >> inbound_data_size))
+        T result;
+        std::size_t data_size = 0;
+        frame_state state;
+        while ((state = buffered_frame( data_size)) == frame_state::incomplete)
+        {
+            received( socket_.read_some( receive_space( data_size)));
+        }
+
+        if (state == frame_state::invalid || !decode_frame( data_size, result))
         {
-            // Header doesn't seem to be valid. Inform the caller.
             throw boost::system::error_code{boost::asio::error::invalid_argument};
         }
+        return result;
+    }
 
-        inbound_data_.resize(inbound_data_size);
-        boost::asio::read( socket_, boost::asio::buffer( inbound_data_));
+    /// Read a data structure from the socket, but only if a complete message has
+    /// already been received, so that this never blocks. Returns false if no complete
+    /// message was available or if it could not be read. This should not be called
+    /// while an asynchronous read is in progress.
+    template< typename T>
+    bool try_read( T &t)
+    {
+        std::size_t data_size = 0;
+        frame_state state = buffered_frame( data_size);
+        if (state == frame_state::incomplete && uring_)
+        {
+            // Pick up whatever the ring has received so far.
+            boost::system::error_code error;
+            if (uring_->receive(receiver_, ring_received_, error, nullptr) && !error)
+            {
+                store_ring_received();
+                state = buffered_frame( data_size);
+            }
+        }
+        else if (state == frame_state::incomplete)
+        {
+            // Pick up whatever the socket has received so far, without blocking.
+            boost::system::error_code error;
+            const std::size_t bytes = receive_available( receive_space( data_size), error);
+            if (error)
+            {
+                release_empty_buffer();
+                return false;
+            }
+            received( bytes);
+            state = buffered_frame( data_size);
+        }
 
-        stream<basic_array_source<char>> dataStream{ &inbound_data_[0], inbound_data_.size()};
-        binary_iarchive archive{ dataStream};
+        return state == frame_state::complete && decode_frame( data_size, t);
+    }
 
-        archive >> result;
+    /// Read a data structure from the socket synchronously, but give up when the deadline
+    /// passes, which is reported as a timed_out error. With busy polling options, the socket
+    /// is polled in a loop instead of waited for. This should not be called while an
+    /// asynchronous read is in progress.
+    template< typename T>
+    boost::system::error_code read_before( T &t,
+        std::chrono::steady_clock::time_point deadline,
+        const BusyPollOptions *busyPolling = nullptr)
+    {
+        BusyPollBackoff backoff{ busyPolling ? *busyPolling : BusyPollOptions{}};
+        std::size_t data_size = 0;
+        frame_state state;
+        while ((state = buffered_frame( data_size)) == frame_state::incomplete)
+        {
+            boost::system::error_code error;
+            const std::size_t bytes = receive_available( receive_space( data_size), error);
+            if (!error)
+            {
+                received( bytes);
+                backoff.reset();
+                continue;
+            }
 
-        return result;
+            release_empty_buffer();
+            if (error != boost::asio::error::would_block) return error;
+            if (std::chrono::steady_clock::now() >= deadline) return boost::asio::error::timed_out;
+
+            if (busyPolling)
+            {
+                backoff.idle();
+            }
+            else if ((error = wait_readable( deadline)))
+            {
+                return error;
+            }
+        }
+
+        if (state == frame_state::invalid || !decode_frame( data_size, t))
+        {
+            return boost::asio::error::invalid_argument;
+        }
+        return boost::system::error_code{};
+    }
+
+    /// Receive the bytes that are available on a readable socket, without blocking.
+    template <typename T, typename Handler>
+    void handle_readable(const boost::system::error_code& e,
+        boost::tuple<Handler> handler)
+    {
+        std::size_t bytes_transferred = 0;
+        boost::system::error_code error = e;
+        if (!error)
+        {
+            bytes_transferred = receive_available(receive_space(0), error);
+            if (error == boost::asio::error::would_block)
+            {
+                // a spurious wake-up: wait again, without holding a buffer.
+                release_empty_buffer();
+                async_read<T>(boost::get<0>(handler));
+                return;
+            }
+        }
+        handle_read_some<T>(error, bytes_transferred, handler);
     }
 
-    /// Handle a completed read of a message header. The handler is passed using
+    /// Handle a completed receive operation. The handler is passed using
     /// a tuple since boost::bind seems to have trouble binding a function object
     /// created using boost::bind as a parameter.
     template <typename T, typename Handler>
-    void handle_read_header(const boost::system::error_code& e,
+    void handle_read_some(const boost::system::error_code& e,
+        std::size_t bytes_transferred,
         boost::tuple<Handler> handler)
     {
         if (e)
         {
             boost::get<0>(handler)(e);
+            return;
         }
-        else
+
+        received( bytes_transferred);
+        std::size_t data_size = 0;
+        switch (buffered_frame( data_size))
         {
-            // Determine the length of the serialized data.
-            std::istringstream is(std::string(inbound_header_, header_length));
-            std::size_t inbound_data_size = 0;
-            if (!(is >> std::hex >> inbound_data_size))
+        case frame_state::incomplete:
+            async_read<T>( boost::get<0>(handler));
+            break;
+
+        case frame_state::invalid:
             {
                 // Header doesn't seem to be valid. Inform the caller.
                 boost::system::error_code error(boost::asio::error::invalid_argument);
                 boost::get<0>(handler)(error);
-                return;
             }
+            break;
 
-            // Start an asynchronous call to receive the data.
-            inbound_data_.resize(inbound_data_size);
-            void (connection::*f)(
-                    const boost::system::error_code&,
-                    boost::tuple<Handler>)
-                    = &connection::handle_read_data<T, Handler>;
-            boost::asio::async_read(socket_, boost::asio::buffer(inbound_data_),
-                    boost::bind(f, this,
-                            boost::asio::placeholders::error, handler));
+        case frame_state::complete:
+            {
+                T t;
+                if (!decode_frame( data_size, t))
+                {
+                    // Unable to decode data.
+                    boost::system::error_code error(boost::asio::error::invalid_argument);
+                    boost::get<0>(handler)(error);
+                    return;
+                }
+
+                // Inform caller that data has been received ok. The handler may
+                // take ownership of the data.
+                boost::get<0>(handler)(e, std::move( t));
+            }
+            break;
         }
     }
 
-    /// Handle a completed read of message data.
-    template <typename T, typename Handler>
-    void handle_read_data(const boost::system::error_code& e,
-            boost::tuple<Handler> handler)
+protected:
+    /// Constructor for derived classes, which pass the size of the complete object, so
+    /// that the pool accounts for their members as well.
+    connection(boost::asio::io_service& io_service,
+        std::shared_ptr<BufferPool> buffers, std::size_t object_size)
+    : socket_(io_service), buffers_(std::move(buffers)), object_size_(object_size)
     {
-        if (e)
+        buffers_->add_connection(object_size_);
+    }
+
+private:
+    /// Serialize a data structure into a frame that consists of a header and
+    /// the serialized data. Returns false if the data is too large for the header.
+    template <typename T>
+    bool make_frame( const T& t, Blob &frame)
+    {
+        using namespace boost::iostreams;
+        using namespace boost::archive;
+
+        // Serialize the data after room for the header, so that header and data can be
+        // sent with a single write operation.
+        frame.assign( header_length, ' ');
+        {
+            stream<back_insert_device<Blob>> dataStream{ frame};
+            binary_oarchive archive{ dataStream};
+
+            archive << t;
+            dataStream.flush();
+        }
+
+        return write_header( frame, frame.size() - header_length);
+    }
+
+    /// Serialize a data structure into a frame, except for the bytes of the tail, if
+    /// they are the last bytes of the serialized data. Otherwise, the tail is reset
+    /// and the frame holds all serialized data.
+    template <typename T>
+    bool make_frame( const T& t, Blob &frame, std::shared_ptr<const Blob> &tail)
+    {
+        frame.assign( header_length, ' ');
+        frame_buffer buffer{ frame, tail.get()};
+        {
+            boost::archive::binary_oarchive archive{ buffer};
+            archive << t;
+        }
+
+        if (!buffer.tail_is_last())
+        {
+            tail.reset();
+            return make_frame( t, frame);
+        }
+        return write_header( frame, frame.size() - header_length + tail->size());
+    }
+
+    /// Format the header at the start of a frame. Returns false if the data size does
+    /// not fit in the header.
+    static bool write_header( Blob &frame, std::size_t data_size)
+    {
+        std::ostringstream header_stream;
+        header_stream << std::setw(header_length)
+                      << std::hex << data_size;
+        if (!header_stream || header_stream.str().size() != header_length)
+        {
+            return false;
+        }
+        const std::string header = header_stream.str();
+        std::copy( header.begin(), header.end(), frame.begin());
+        return true;
+    }
+
+    /// Receives serialized data into a frame, but leaves out the bytes of a tail blob
+    /// when the archive writes them in one piece, straight from that blob.
+    class frame_buffer : public std::streambuf
+    {
+    public:
+        frame_buffer( Blob &frame, const Blob *tail)
+        : frame_( frame), tail_( tail)
         {
-            boost::get<0>(handler)(e);
         }
-        else
+
+        /// Whether the bytes of the tail were left out and nothing was written after them.
+        bool tail_is_last() const
         {
-        	T t;
-            // Extract the data structure from the data just received.
-            try
+            return tail_skipped_ && !written_after_tail_;
+        }
+
+    protected:
+        std::streamsize xsputn( const char *bytes, std::streamsize count) override
+        {
+            if (tail_ && !tail_skipped_ && count && bytes == tail_->data()
+                && static_cast<std::size_t>( count) == tail_->size())
             {
-                using namespace boost::iostreams;
-                using namespace boost::archive;
+                tail_skipped_ = true;
+                return count;
+            }
+
+            written_after_tail_ = written_after_tail_ || tail_skipped_;
+            frame_.insert( frame_.end(), bytes, bytes + count);
+            return count;
+        }
+
+        int_type overflow( int_type c) override
+        {
+            if (!traits_type::eq_int_type( c, traits_type::eof()))
+            {
+                const char byte = traits_type::to_char_type( c);
+                xsputn( &byte, 1);
+            }
+            return traits_type::not_eof( c);
+        }
+
+    private:
+        Blob        &frame_;
+        const Blob  *tail_;
+        bool        tail_skipped_ = false;
+        bool        written_after_tail_ = false;
+    };
+
+    /// A serialized message that waits to be written, with its completion handler. The
+    /// bytes of the tail, if any, are written right after the frame.
+    struct OutboundMessage
+    {
+        Blob frame;
+        std::shared_ptr<const Blob> tail;
+        std::function<void (const boost::system::error_code &)> handler;
+
+        std::size_t size() const
+        {
+            return frame.size() + (tail ? tail->size() : 0);
+        }
+    };
+    typedef std::deque<OutboundMessage> OutboundQueue;
+
+    /// Queue a message and start writing if no write is in progress.
+    void enqueue( OutboundMessage message)
+    {
+        buffers_->add_bytes(message.size());
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        outbound_bytes_ += message.size();
+        auto queue = outbound_queue_.lock();
+        if (!queue)
+        {
+            queue = std::make_shared<OutboundQueue>();
+            outbound_queue_ = queue;
+        }
+        queue->push_back( std::move( message));
+        if (!writing_)
+        {
+            write_next( queue);
+        }
+    }
+
+    /// Write as many of the queued frames as possible with a single gather write.
+    /// This is called with the write mutex locked.
+    void write_next( const std::shared_ptr<OutboundQueue> &queue)
+    {
+        std::vector<boost::asio::const_buffer> buffers;
+        writing_ = 0;
+        for (auto &message : *queue)
+        {
+            if (writing_ == max_write_batch) break;
+            buffers.push_back( boost::asio::buffer( message.frame));
+            if (message.tail) buffers.push_back( boost::asio::buffer( *message.tail));
+            ++writing_;
+        }
 
-                // Serialize the data first so we know how large it is.
-                stream<basic_array_source<char>> dataStream{ &inbound_data_[0], inbound_data_.size()};
-                binary_iarchive archive{ dataStream};
+        if (uring_)
+        {
+            uring_->send(socket_.native_handle(), buffers,
+                    [this, queue](const boost::system::error_code& e) { handle_write(e, queue); });
+            return;
+        }
+        boost::asio::async_write(socket_, buffers,
+                boost::bind(&connection::handle_write, this,
+                        boost::asio::placeholders::error, queue));
+    }
 
-                archive >> t;
+    void handle_write(const boost::system::error_code& e, const std::shared_ptr<OutboundQueue> &queue)
+    {
+        std::vector<std::function<void (const boost::system::error_code &)>> handlers;
+        {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            for (; writing_; --writing_)
+            {
+                handlers.push_back( std::move( queue->front().handler));
+                outbound_bytes_ -= queue->front().size();
+                buffers_->remove_bytes( queue->front().size());
+                queue->pop_front();
             }
-            catch (std::exception& e)
+            if (!queue->empty())
             {
-                // Unable to decode data.
-                boost::system::error_code error(boost::asio::error::invalid_argument);
-                boost::get<0>(handler)(error);
-                return;
+                write_next( queue);
             }
+        }
 
-            // Inform caller that data has been received ok.
-            boost::get<0>(handler)(e, t);
+        // the handlers may queue new writes.
+        for (auto &handler : handlers)
+        {
+            handler( e);
         }
     }
 
-private:
+    enum class frame_state { incomplete, complete, invalid };
+
+    /// Find out whether a complete frame has been buffered. If the header has been
+    /// buffered, data_size is set to the size of the data that follows it.
+    frame_state buffered_frame( std::size_t &data_size) const
+    {
+        const std::size_t buffered = inbound_end_ - inbound_begin_;
+        if (buffered < header_length) return frame_state::incomplete;
+        if (!parse_header( &inbound_buffer_[inbound_begin_], data_size)) return frame_state::invalid;
+        return buffered < header_length + data_size ? frame_state::incomplete : frame_state::complete;
+    }
+
+    /// Parse a header, which is the data size in hexadecimal, padded with spaces on the left.
+    static bool parse_header( const char *header, std::size_t &data_size)
+    {
+        std::size_t position = 0;
+        while (position < header_length && header[position] == ' ') ++position;
+        if (position == header_length) return false;
+
+        data_size = 0;
+        for (; position < header_length; ++position)
+        {
+            const char c = header[position];
+            int digit;
+            if (c >= '0' && c <= '9') digit = c - '0';
+            else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+            else return false;
+            data_size = data_size * 16 + digit;
+        }
+        return true;
+    }
+
+    /// De-serialize the buffered frame and remove it from the buffer, also if it
+    /// can not be de-serialized.
+    template <typename T>
+    bool decode_frame( std::size_t data_size, T &t)
+    {
+        using namespace boost::iostreams;
+        using namespace boost::archive;
+
+        const char *data = &inbound_buffer_[inbound_begin_ + header_length];
+        if (capture_ && capture_->active())
+        {
+            capture_->record( capture_id_, &inbound_buffer_[inbound_begin_], header_length + data_size);
+        }
+        inbound_begin_ += header_length + data_size;
+
+        bool decoded = true;
+        try
+        {
+            stream<basic_array_source<char>> dataStream{ data, data_size};
+            binary_iarchive archive{ dataStream};
+            archive >> t;
+        }
+        catch (std::exception &)
+        {
+            decoded = false;
+        }
+
+        // once everything has been consumed, the buffer can be used by other connections.
+        release_empty_buffer();
+        return decoded;
+    }
+
+    /// Administer bytes that were received into the receive buffer.
+    void received( std::size_t bytes)
+    {
+        inbound_end_ += bytes;
+        if (quick_ack_ && bytes)
+        {
+            RenewQuickAck(socket_);
+        }
+    }
+
+    /// Move the bytes that the ring has received for this connection into the receive buffer,
+    /// or let the ring call back once it has received more. The handler is posted, unless this
+    /// is called back by the ring, which happens from within the io_service already.
+    template <typename T, typename Handler>
+    void receive_from_ring(Handler handler, bool called_back)
+    {
+        boost::system::error_code error;
+        if (!uring_->receive(receiver_, ring_received_, error,
+                [this, handler]() { receive_from_ring<T>(handler, true); }))
+        {
+            return;
+        }
+
+        store_ring_received();
+        if (called_back)
+        {
+            handle_read_some<T>(error, 0, boost::make_tuple(handler));
+            return;
+        }
+
+        void (connection::*f)(
+                const boost::system::error_code&,
+                std::size_t,
+                boost::tuple<Handler>)
+                = &connection::handle_read_some<T, Handler>;
+        socket_.get_io_service().post(
+                boost::bind(f, this, error, 0, boost::make_tuple(handler)));
+    }
+
+    /// Copy the bytes that were taken from the ring into the receive buffer.
+    void store_ring_received()
+    {
+        const Blob& data = ring_received_;
+        for (std::size_t copied = 0; copied < data.size();)
+        {
+            std::size_t data_size = 0;
+            buffered_frame(data_size);
+            const auto space = receive_space(data_size);
+            const std::size_t bytes = std::min(space.size(), data.size() - copied);
+            std::memcpy(space.data(), &data[copied], bytes);
+            received(bytes);
+            copied += bytes;
+        }
+
+        // the ring receives into this blob next time, so keep it unless it has grown large.
+        if (ring_received_.capacity() > buffers_->buffer_size())
+        {
+            Blob().swap(ring_received_);
+        }
+        ring_received_.clear();
+    }
+
+    /// Receive the bytes that the socket has received so far, without blocking, into the
+    /// given buffer. Reports would_block if there are none and eof if the other side has
+    /// closed the connection.
+    std::size_t receive_available(boost::asio::mutable_buffers_1 buffer, boost::system::error_code& error)
+    {
+#if defined(MSG_DONTWAIT)
+        // A single system call, whatever the blocking mode of the socket is.
+        for (;;)
+        {
+            const ssize_t result = ::recv(socket_.native_handle(), buffer.data(), buffer.size(), MSG_DONTWAIT);
+            if (result > 0)
+            {
+                error = boost::system::error_code{};
+                return static_cast<std::size_t>(result);
+            }
+            if (result == 0)
+            {
+                error = boost::asio::error::eof;
+            }
+            else if (errno == EINTR)
+            {
+                continue;
+            }
+            else if (errno == EWOULDBLOCK || errno == EAGAIN)
+            {
+                error = boost::asio::error::would_block;
+            }
+            else
+            {
+                error = boost::system::error_code(errno, boost::asio::error::get_system_category());
+            }
+            return 0;
+        }
+#else
+        socket_.non_blocking(true, error);
+        if (error) return 0;
+        const std::size_t bytes = socket_.read_some(buffer, error);
+        boost::system::error_code ignored;
+        socket_.non_blocking(false, ignored);
+        return bytes;
+#endif
+    }
+
+    /// Wait until the socket is readable or the deadline has passed.
+    boost::system::error_code wait_readable(std::chrono::steady_clock::time_point deadline)
+    {
+        boost::system::error_code error;
+#if defined(POLLIN) && !defined(_WIN32)
+        int timeout = -1;
+        if (deadline != std::chrono::steady_clock::time_point::max())
+        {
+            using std::chrono::milliseconds;
+            const auto remaining = std::chrono::duration_cast<milliseconds>(deadline - std::chrono::steady_clock::now()).count() + 1;
+            timeout = static_cast<int>(std::max<decltype(remaining)>(0, std::min<decltype(remaining)>(remaining, INT_MAX)));
+        }
+        pollfd descriptor{ socket_.native_handle(), POLLIN, 0};
+        if (::poll(&descriptor, 1, timeout) < 0 && errno != EINTR)
+        {
+            error = boost::system::error_code(errno, boost::asio::error::get_system_category());
+        }
+#else
+        // no timeout on this platform, the caller checks the deadline after the wait.
+        socket_.wait(boost::asio::socket_base::wait_read, error);
+#endif
+        return error;
+    }
+
+    /// Give the receive buffer back to the pool if it holds no received bytes.
+    void release_empty_buffer()
+    {
+        if (inbound_begin_ != inbound_end_) return;
+        inbound_begin_ = inbound_end_ = 0;
+        buffers_->give_back( inbound_buffer_);
+    }
+
+    /// Make room in the receive buffer for at least the rest of the current frame and
+    /// return the free part of the buffer. A connection without a buffer borrows one
+    /// first. The buffer only grows beyond the size of the pooled buffers for a frame
+    /// that does not fit in them, otherwise the buffered bytes are moved to the front.
+    boost::asio::mutable_buffers_1 receive_space( std::size_t data_size)
+    {
+        if (inbound_buffer_.empty())
+        {
+            inbound_buffer_ = buffers_->borrow();
+        }
+
+        const std::size_t buffered = inbound_end_ - inbound_begin_;
+        if (inbound_begin_ && buffered)
+        {
+            std::copy( inbound_buffer_.begin() + inbound_begin_, inbound_buffer_.begin() + inbound_end_, inbound_buffer_.begin());
+        }
+        inbound_begin_ = 0;
+        inbound_end_ = buffered;
+
+        const std::size_t frame_size = buffered < header_length ? 0 : header_length + data_size;
+        const std::size_t needed = std::max( { frame_size, buffers_->buffer_size(), buffered + 1});
+        if (inbound_buffer_.size() < needed)
+        {
+            const std::size_t capacity = inbound_buffer_.capacity();
+            inbound_buffer_.resize( needed);
+            buffers_->add_bytes( inbound_buffer_.capacity() - capacity);
+        }
+        return boost::asio::buffer( &inbound_buffer_[inbound_end_], inbound_buffer_.size() - inbound_end_);
+    }
+
     /// The underlying socket.
     boost::asio::ip::tcp::socket socket_;
 
     /// The size of a fixed length header.
     enum { header_length = 8 };
 
-    /// Holds an outbound header.
-    std::string outbound_header_;
+    /// Protects the outbound queue, its size and the number of frames being written.
+    mutable std::mutex write_mutex_;
+
+    /// The messages that have not been written yet. The write in progress owns them, like
+    /// asio owns the handler of a single write, because their handlers may own this connection.
+    /// A connection that is destroyed along with its io_service is then not kept alive by its
+    /// own queue. An idle connection has no queue.
+    std::weak_ptr<OutboundQueue> outbound_queue_;
+
+    /// The total size of the messages in the outbound queue.
+    std::size_t outbound_bytes_ = 0;
+
+    /// The maximum number of frames that are written with a single write operation.
+    enum { max_write_batch = 64 };
+
+    /// Whether to renew TCP_QUICKACK after every receive.
+    bool quick_ack_ = false;
+
+    /// The number of frames at the front of the outbound queue that are being written. There
+    /// is a write in progress, and so an outbound queue, while this is not zero.
+    std::size_t writing_ = 0;
+
+    /// The capture that received frames are recorded in, if any, and the number of this
+    /// connection in that capture.
+    std::shared_ptr<TrafficCapture> capture_;
+    std::uint32_t capture_id_ = 0;
+
+    /// The pool that receive buffers are borrowed from.
+    std::shared_ptr<BufferPool> buffers_;
+
+    /// The size of the complete connection object, as accounted for in the pool.
+    const std::size_t object_size_;
 
-    /// Holds the outbound data.
-    Blob outbound_data_;
+    /// The ring that sends and receives for this connection with Transport::IoUring, if any,
+    /// and the receiver of this connection in that ring.
+    std::shared_ptr<IoUringTransport> uring_;
+    IoUringTransport::ReceiverId receiver_ = 0;
 
-    /// Holds an inbound header.
-    char inbound_header_[header_length];
+    /// The bytes that were last taken from the ring. They are exchanged for the blob that
+    /// the ring receives into, so that neither is allocated for every receive.
+    Blob ring_received_;
 
-    /// Holds the inbound data.
-    Blob inbound_data_;
+    /// Holds received bytes. The bytes from inbound_begin_ to inbound_end_ have not been
+    /// consumed yet. This is empty if nothing has been buffered.
+    Blob inbound_buffer_;
+    std::size_t inbound_begin_ = 0;
+    std::size_t inbound_end_ = 0;
 };
 
 typedef boost::shared_ptr<connection> connection_ptr;
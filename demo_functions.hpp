@@ -35,5 +35,33 @@ std::string addAll( const Information &inf)
     return inf.first + inf.second;
 }
 
+/// Count the words in a text. The text is not copied out of the received message.
+int countWords( StringView text)
+{
+    int words = 0;
+    bool inWord = false;
+    for (char c : text)
+    {
+        const bool isSpace = c == ' ' || c == '\t' || c == '\n';
+        if (!isSpace && !inWord) ++words;
+        inWord = !isSpace;
+    }
+    return words;
+}
+
+/// Generate the squares of all numbers in the range [begin, end), one at a time.
+Generator<int> squares( int begin, int end)
+{
+    return Generator<int>{
+        [begin, end]( int &value) mutable
+        {
+            if (begin >= end) return false;
+            value = begin * begin;
+            ++begin;
+            return true;
+        }
+    };
+}
+
 
 #endif /* DEMO_FUNCTIONS_HPP_ */
@@ -8,9 +8,13 @@
 
 
 
+#include <atomic>
 #include <iostream>
 #include <string>
 #include <map>
+#include <memory>
+#include <thread>
+#include <vector>
 
 #include "function_interface.hpp"
 #include "binary_function_marshaller.hpp"
@@ -20,6 +24,9 @@
 
 #include "rpc_proxy.hpp"
 #include "rpc_service.hpp"
+#include "rpc_proxy_pool.hpp"
+#include "balancing_rpc_proxy.hpp"
+#include "fan_out_rpc_proxy.hpp"
 
 
 // call functions on the remote server
@@ -28,34 +35,108 @@ void client( const std::string &host, const std::string &port)
     boost::asio::io_service io_service;
     RpcProxy proxy{ io_service, host, port};
 
-    // create a function proxy by giving an explicit function prototype
-    auto remoteAdd = CreateProxyFunction<int (int, int)>( proxy, "add");
+    // create a function proxy by giving an explicit function prototype.
+    // Calls of this proxy give up if there is no answer within a second.
+    auto remoteAdd = CreateProxyFunction<int (int, int)>( proxy, "add", std::chrono::seconds( 1));
 
     // create a function proxy by giving an example function prototype.
     // Note that this will never call the addAll function locally, it's
     // just used to provide a function prototype.
     auto remoteAddAll = CreateProxyFunction( addAll, proxy, "addAll");
 
+    // the server receives the text as a view, but the client may send a string.
+    auto remoteCountWords = CreateProxyFunction<int (const std::string &)>( proxy, "countWords");
+
+    // a function that returns a Generator results in a proxy that
+    // receives the values one by one, as the server produces them.
+    auto remoteSquares = CreateProxyFunction( squares, proxy, "squares");
+
     // call the functions on the remote server.
     std::cout << remoteAdd( 40,2 ) << '\n';
     std::cout << remoteAddAll( {"hello there, ", "world!"}) << '\n';
+    std::cout << remoteCountWords( "the quick brown fox") << '\n';
+    for (auto square : remoteSquares( 1, 6))
+    {
+        std::cout << square << ' ';
+    }
+    std::cout << '\n';
 }
 
 // start a service that implements a number of registered functions.
-void server( unsigned short port)
+// If a capture file is given, the received calls are recorded in it, so that
+// they can be replayed with rpc_replay.
+void server( unsigned short port, const std::string &capture = std::string())
 {
     std::cout << "Running service on port " << port << '\n';
 
     boost::asio::io_service io_service;
     RpcService service{ io_service, port};
+    if (!capture.empty() && !service.start_capture( capture))
+    {
+        std::cerr << "Can not write to capture file " << capture << '\n';
+    }
 
-    // register two functions
+    // register the functions
     service.register_function( "addAll", addAll);
     service.register_function( "add", add);
+    service.register_function( "countWords", countWords);
+
+    // streams of results are bulk work, don't let them delay the other calls.
+    service.register_function( "squares", squares, Priority::Low);
 
     io_service.run(); // wait for incoming calls.
 }
 
+// start a few services in this process and spread calls over them: through a
+// pool of connections that several threads share, through a balancer that
+// picks a service for every call and with a call that goes to all of them.
+void cluster()
+{
+    boost::asio::io_service io_service;
+    std::vector<std::unique_ptr<RpcService>> services;
+    std::vector<RpcAddress> addresses;
+    for (unsigned short port = 65433; port < 65436; ++port)
+    {
+        services.emplace_back( new RpcService{ io_service, port});
+        services.back()->register_function( "add", add);
+        services.back()->register_function( "countWords", countWords);
+        addresses.push_back( RpcAddress{ "localhost", std::to_string( port)});
+    }
+    std::thread serviceThread{ [&io_service](){ io_service.run();}};
+
+    {
+        // a pool can be called from any number of threads at the same time.
+        RpcProxyPool pool{ addresses.front().host, addresses.front().service};
+        auto pooledAdd = CreateProxyFunction( add, pool, "add");
+        std::atomic<int> total{ 0};
+        std::vector<std::thread> callers;
+        for (int caller = 0; caller < 4; ++caller)
+        {
+            callers.emplace_back( [&pooledAdd, &total, caller](){ total += pooledAdd( caller, 10);});
+        }
+        for (auto &caller : callers) caller.join();
+        std::cout << total << '\n';
+
+        // a balancer sends every call to the service that is likely to reply first.
+        // Calls of idempotent functions are sent to a second service if the first is slow.
+        BalancingRpcProxy balancer{ addresses};
+        auto balancedAdd = CreateProxyFunction( add, balancer, "add");
+        auto hedgedCountWords = CreateIdempotentProxyFunction<int (const std::string &)>( balancer, "countWords");
+        std::cout << balancedAdd( 40, 2) << '\n';
+        std::cout << hedgedCountWords( "the quick brown fox") << '\n';
+
+        // a fan-out function calls every service and combines their results.
+        FanOutRpcProxy everyService{ addresses};
+        auto countEverywhere = CreateFanOutFunction<int (const std::string &)>(
+                everyService, "countWords", []( int sum, int words){ return sum + words;}, 0);
+        const auto counted = countEverywhere( "jumps over the lazy dog");
+        std::cout << counted.value << (counted.complete() ? "" : " (incomplete)") << '\n';
+    }
+
+    io_service.stop();
+    serviceThread.join();
+}
+
 // just run some functions in-proc via the rpc mechanism.
 void inproc()
 {
@@ -73,7 +154,17 @@ void inproc()
     std::cout << wrappedStrings( "hello ", "world") << '\n';
 
     auto wrappedAddAll = Marshal( addAll, functions["addAll"]);
-    std::cout << wrappedAddAll( {"hello ", "there"});
+    std::cout << wrappedAddAll( {"hello ", "there"}) << '\n';
+
+    auto wrappedCountWords = Marshal( countWords, Wrap( countWords));
+    std::cout << wrappedCountWords( "jumps over the lazy dog") << '\n';
+
+    auto wrappedSquares = Marshal( squares, Wrap( squares));
+    for (auto square : wrappedSquares( 1, 6))
+    {
+        std::cout << square << ' ';
+    }
+    std::cout << '\n';
 }
 
 int main( int argc, const char *argv[])
@@ -82,7 +173,11 @@ int main( int argc, const char *argv[])
     {
         if (argv[1] == std::string("server"))
         {
-            server( 65432);
+            server( 65432, argc >= 3 ? argv[2] : "");
+        }
+        else if (argv[1] == std::string("cluster"))
+        {
+            cluster();
         }
         else
         {
@@ -0,0 +1,280 @@
+//
+//  Copyright (C) 2017 Danny Havenith
+//
+//  Distributed under the Boost Software License, Version 1.0. (See
+//  accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt)
+//
+#ifndef FAN_OUT_RPC_PROXY_HPP_
+#define FAN_OUT_RPC_PROXY_HPP_
+
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "rpc_proxy_pool.hpp"
+#include "binary_function_marshaller.hpp"
+
+/**
+ * The outcome of a call on one of the services of a FanOutRpcProxy.
+ */
+struct ShardReply
+{
+    Blob                result;
+    std::exception_ptr  error;  ///< set if the service did not produce a result
+};
+
+/**
+ * A thread-safe proxy that sends the same call to every service in a set,
+ * for instance to every shard of a partitioned service.
+ *
+ * The calls are sent in parallel, each over an RpcProxyPool of its own
+ * service, so the latency of a fan-out call is that of the slowest service
+ * instead of the sum of all latencies. A deadline limits the wait: services
+ * that have not replied by then are reported as failed, so that the caller
+ * can work with a partial result.
+ *
+ * Typically, this class is not called directly, but through a FanOutFunction.
+ */
+class FanOutRpcProxy
+{
+public:
+    typedef RpcProxy::Clock Clock;
+
+    FanOutRpcProxy(
+        const std::vector<RpcAddress> &addresses,
+        const RpcProxyPoolOptions &options = RpcProxyPoolOptions{})
+    {
+        for (const auto &address : addresses)
+        {
+            m_pools.emplace_back( new RpcProxyPool{ address.host, address.service, options});
+        }
+    }
+
+    /// The number of services that every call is sent to.
+    std::size_t size() const
+    {
+        return m_pools.size();
+    }
+
+    /**
+     * Send a call of a regular function to every service and wait for the replies.
+     *
+     * The parameters are serialized once, and the same bytes are sent to every service
+     * straight from the shared blob. Returns the reply of every service, in the
+     * order in which the services were given to the constructor. If a deadline is given,
+     * it is sent along with the calls, so that services drop calls that they can not start
+     * in time, and services that have not replied when it expires fail with
+     * boost::asio::error::timed_out.
+     */
+    std::vector<ShardReply> call( const std::string &name, std::shared_ptr<const Blob> parameters, Clock::duration deadline = Clock::duration::zero())
+    {
+        const auto start = Clock::now();
+        auto gather = std::make_shared<Gather>( m_pools.size());
+
+        std::vector<RpcProxyPool::AsyncCallPtr> calls( m_pools.size());
+        for (std::size_t shard = 0; shard < m_pools.size(); ++shard)
+        {
+            // this does not block, so a service that can not be reached does not delay the others.
+            calls[shard] = m_pools[shard]->async_call( name, parameters, deadline,
+                [gather, shard]( const boost::system::error_code &e, RpcReply &reply)
+                {
+                    std::lock_guard<std::mutex> lock{ gather->mutex};
+                    gather->complete( shard, e, reply);
+                });
+        }
+
+        std::unique_lock<std::mutex> lock{ gather->mutex};
+        const auto done = [&]{ return !gather->remaining;};
+        if (deadline == Clock::duration::zero())
+        {
+            gather->arrived.wait( lock, done);
+        }
+        else if (!gather->arrived.wait_until( lock, start + deadline, done))
+        {
+            // the pools time out the calls themselves, but there is no need to wait for them.
+            for (std::size_t shard = 0; shard < calls.size(); ++shard)
+            {
+                if (gather->completed[shard]) continue;
+
+                RpcReply none;
+                gather->complete( shard, boost::asio::error::timed_out, none);
+                m_pools[shard]->cancel( calls[shard]);
+            }
+        }
+
+        return std::move( gather->replies);
+    }
+
+private:
+    /// The replies of a fan-out call, which are shared with the reply handlers.
+    struct Gather
+    {
+        explicit Gather( std::size_t shards)
+        : remaining( shards), completed( shards), replies( shards)
+        {
+        }
+
+        /// Store the reply of a service. This is called with the mutex locked.
+        void complete( std::size_t shard, const boost::system::error_code &e, RpcReply &reply)
+        {
+            if (completed[shard]) return;
+            completed[shard] = true;
+
+            ShardReply &result = replies[shard];
+            try
+            {
+                if (e) throw boost::system::system_error( e);
+                RpcProxy::check_error( reply);
+                result.result = std::move( std::get<2>( reply));
+            }
+            catch (...)
+            {
+                result.error = std::current_exception();
+            }
+
+            if (!--remaining) arrived.notify_one();
+        }
+
+        std::mutex                  mutex;
+        std::condition_variable     arrived;
+        std::size_t                 remaining;
+        std::vector<bool>           completed;
+        std::vector<ShardReply>     replies;
+    };
+
+    std::vector<std::unique_ptr<RpcProxyPool>> m_pools;
+};
+
+/**
+ * The result of a FanOutFunction call.
+ */
+template<typename ValueType>
+struct GatherResult
+{
+    /// The reduced results of the services that replied.
+    ValueType value;
+
+    /// The error of every service that did not produce a result, or a result that could
+    /// not be decoded, by its index.
+    std::map<std::size_t, std::exception_ptr> failures;
+
+    /// Whether every service contributed to the value.
+    bool complete() const
+    {
+        return failures.empty();
+    }
+};
+
+/**
+ * A functor that calls the same function on every service of a FanOutRpcProxy
+ * and combines the results with a reducer.
+ *
+ * The arguments are serialized only once. The reducer is called with the
+ * reduction so far, starting with an initial value, and the result of a
+ * service, for every service that replied, in the order of the services.
+ */
+template<typename FunctionType, typename ReducedType>
+class FanOutFunction
+{
+};
+
+template<typename ReturnType, typename... Parameters, typename ReducedType>
+class FanOutFunction< ReturnType (Parameters...), ReducedType>
+{
+public:
+    typedef std::function<ReducedType (ReducedType, ReturnType)> Reducer;
+    typedef RpcProxy::Clock::duration Duration;
+
+    FanOutFunction(
+        FanOutRpcProxy &proxy,
+        const std::string &name,
+        Reducer reducer,
+        ReducedType initial,
+        Duration deadline = Duration::zero())
+    : m_proxy( proxy), m_functionName{ name}, m_reducer{ reducer}, m_initial{ initial}, m_deadline{ deadline}
+    {
+    }
+
+    GatherResult<ReducedType> operator()( MarshalledParameter<Parameters>... pars)
+    {
+        auto replies = m_proxy.call( m_functionName, std::make_shared<const Blob>( MarshalParameters( pars...)), m_deadline);
+
+        GatherResult<ReducedType> result{ m_initial, {}};
+        for (std::size_t shard = 0; shard < replies.size(); ++shard)
+        {
+            if (replies[shard].error)
+            {
+                result.failures[shard] = replies[shard].error;
+                continue;
+            }
+
+            // a reply that can not be decoded only fails its own service.
+            ReturnType value;
+            try
+            {
+                UnmarshalValue( replies[shard].result, value);
+            }
+            catch (...)
+            {
+                result.failures[shard] = std::current_exception();
+                continue;
+            }
+            result.value = m_reducer( std::move( result.value), std::move( value));
+        }
+        return result;
+    }
+
+private:
+    FanOutRpcProxy      &m_proxy;
+    const std::string   m_functionName;
+    Reducer             m_reducer;
+    const ReducedType   m_initial;
+    const Duration      m_deadline;
+};
+
+/**
+ * Create a fan-out function from an existing function prototype.
+ *
+ * If a deadline is given, every call returns when it expires, with the results
+ * of the services that replied in time.
+ *
+ * @see FanOutFunction
+ */
+template<typename ReturnType, typename... Parameters, typename Reducer, typename ReducedType>
+FanOutFunction< ReturnType (Parameters...), ReducedType> CreateFanOutFunction(
+        ReturnType (*)( Parameters...),
+        FanOutRpcProxy &proxy,
+        const std::string &functionName,
+        Reducer reducer,
+        ReducedType initial,
+        RpcProxy::Clock::duration deadline = RpcProxy::Clock::duration::zero()
+    )
+{
+    return FanOutFunction< ReturnType (Parameters...), ReducedType>{ proxy, functionName, reducer, initial, deadline};
+}
+
+/**
+ * Create a fan-out function from an explicitly specified function prototype.
+ *
+ * @see FanOutFunction
+ */
+template<typename FunctionType, typename Reducer, typename ReducedType>
+FanOutFunction< FunctionType, ReducedType> CreateFanOutFunction(
+        FanOutRpcProxy &proxy,
+        const std::string &functionName,
+        Reducer reducer,
+        ReducedType initial,
+        RpcProxy::Clock::duration deadline = RpcProxy::Clock::duration::zero()
+    )
+{
+    return FanOutFunction< FunctionType, ReducedType>{ proxy, functionName, reducer, initial, deadline};
+}
+
+#endif /* FAN_OUT_RPC_PROXY_HPP_ */
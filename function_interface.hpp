@@ -10,6 +10,7 @@
 
 #include <vector>
 #include "blob.hpp"
+#include "generator.hpp"
 
 
 class FunctionInterface
@@ -21,4 +22,22 @@ public:
     virtual ~FunctionInterface(){}
 };
 
+/// A sequence of serialized values, as produced by a streaming function.
+using BlobGenerator = Generator<Blob>;
+
+/**
+ * Interface for functions that produce their result as a sequence of
+ * values instead of as a single value.
+ *
+ * Each Blob that the returned generator produces holds one serialized value.
+ */
+class StreamFunctionInterface
+{
+public:
+
+    virtual BlobGenerator CallStream(const Blob &parameters) = 0;
+
+    virtual ~StreamFunctionInterface(){}
+};
+
 #endif /* FUNCTION_INTERFACE_HPP_ */
@@ -0,0 +1,160 @@
+//
+//  Copyright (C) 2017 Danny Havenith
+//
+//  Distributed under the Boost Software License, Version 1.0. (See
+//  accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt)
+//
+#ifndef FUNCTION_REGISTRY_HPP_
+#define FUNCTION_REGISTRY_HPP_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "function_interface.hpp"
+
+/**
+ * Priority class of a registered function.
+ *
+ * Calls of functions in a higher class are run before calls of functions
+ * in a lower class that are waiting at the same time.
+ */
+enum class Priority : std::uint8_t
+{
+    High,
+    Normal,
+    Low
+};
+
+/// The number of priority classes.
+enum { PriorityCount = 3 };
+
+/**
+ * A function as it is registered with an RpcService. Exactly one of the
+ * function pointers is set.
+ */
+struct RegisteredFunction
+{
+    std::shared_ptr<FunctionInterface>       function;   ///< set for regular functions
+    std::shared_ptr<StreamFunctionInterface> stream;     ///< set for functions that return a Generator
+    Priority                                 priority = Priority::Normal;
+};
+
+/**
+ * A map of function name to RegisteredFunction that is optimized for lookups.
+ *
+ * Lookups are wait-free and can run concurrently with changes. Each change
+ * copies the map, modifies the copy and publishes it as the new current map.
+ * The old map is deleted as soon as all lookups that might still be reading
+ * it have finished, in the same way as read-copy-update (RCU) does it: a
+ * lookup registers itself in one of two reader counters, selected by the
+ * current epoch, and a change flips the epoch twice, waiting each time for
+ * the readers of the previous epoch to leave.
+ *
+ * A lookup returns a copy of the registration, so a function that is replaced
+ * or removed stays alive until the calls that are using it have finished.
+ *
+ * Changes are serialized by a mutex and may have to wait for lookups in
+ * progress, so they are relatively expensive.
+ */
+class FunctionRegistry
+{
+public:
+    typedef std::map<std::string, RegisteredFunction> Map;
+
+    FunctionRegistry()
+    :m_current{ new Map}
+    {
+    }
+
+    FunctionRegistry( const FunctionRegistry &) = delete;
+    FunctionRegistry &operator=( const FunctionRegistry &) = delete;
+
+    ~FunctionRegistry()
+    {
+        delete m_current.load();
+    }
+
+    /// Find a function by name. Returns false if there is no function with that name.
+    bool find( const std::string &name, RegisteredFunction &result) const
+    {
+        ReadGuard guard{ *this};
+
+        const Map &functions = *m_current.load();
+        auto function = functions.find( name);
+        if (function == functions.end()) return false;
+
+        result = function->second;
+        return true;
+    }
+
+    /// Add a function, or replace the function that was registered under the same name.
+    void add( const std::string &name, const RegisteredFunction &function)
+    {
+        std::lock_guard<std::mutex> lock{ m_writeMutex};
+        std::unique_ptr<Map> next{ new Map( *m_current.load())};
+        (*next)[name] = function;
+        publish( std::move( next));
+    }
+
+    /// Remove a function. Returns false if there was no function with that name.
+    bool remove( const std::string &name)
+    {
+        std::lock_guard<std::mutex> lock{ m_writeMutex};
+        std::unique_ptr<Map> next{ new Map( *m_current.load())};
+        if (!next->erase( name)) return false;
+        publish( std::move( next));
+        return true;
+    }
+
+private:
+    /// Marks a lookup in progress for the duration of its scope.
+    class ReadGuard
+    {
+    public:
+        explicit ReadGuard( const FunctionRegistry &registry)
+        :m_readers( registry.m_readers[ registry.m_epoch.load() & 1])
+        {
+            ++m_readers;
+        }
+
+        ~ReadGuard()
+        {
+            --m_readers;
+        }
+
+    private:
+        std::atomic<std::size_t> &m_readers;
+    };
+
+    /// Make a new map current and delete the old one once no lookup can be using it.
+    void publish( std::unique_ptr<Map> next)
+    {
+        std::unique_ptr<Map> previous{ m_current.exchange( next.release())};
+
+        // A lookup that still uses the previous map registered itself with the epoch that
+        // it saw. That is either the current epoch or, if it read the epoch just before an
+        // earlier flip, the one before it. Flipping twice waits for both.
+        for (int phase = 0; phase < 2; ++phase)
+        {
+            const auto epoch = m_epoch++;
+            while (m_readers[epoch & 1].load())
+            {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    std::atomic<Map *>                          m_current;
+    std::atomic<std::size_t>                    m_epoch{ 0};
+    mutable std::array<std::atomic<std::size_t>, 2> m_readers{};
+    std::mutex                                  m_writeMutex;
+};
+
+#endif /* FUNCTION_REGISTRY_HPP_ */
@@ -0,0 +1,127 @@
+//
+//  Copyright (C) 2017 Danny Havenith
+//
+//  Distributed under the Boost Software License, Version 1.0. (See
+//  accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt)
+//
+#ifndef GENERATOR_HPP_
+#define GENERATOR_HPP_
+
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <utility>
+
+/**
+ * A generator produces a sequence of values of type T, one at a time.
+ *
+ * A generator is created from any callable that accepts a T reference. Each
+ * time the callable is invoked it should either assign the next value and
+ * return true, or return false to signal the end of the sequence.
+ *
+ * Functions that return a Generator can be registered with an RpcService. The
+ * service will then send every value as a separate frame, so that the client
+ * can start consuming values before the sequence is complete.
+ *
+ * Generators can be iterated over with a range-based for loop. Iteration
+ * consumes the values, so a generator can only be iterated once.
+ */
+template<typename T>
+class Generator
+{
+public:
+    using value_type = T;
+    using Function = std::function< bool ( T &)>;
+
+    class iterator
+    {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T *;
+        using reference = const T &;
+
+        iterator() = default;
+
+        explicit iterator( Generator *generator)
+        :m_generator{ generator}
+        {
+            ++*this;
+        }
+
+        const T &operator*() const { return m_generator->m_current;}
+        const T *operator->() const { return &m_generator->m_current;}
+
+        iterator &operator++()
+        {
+            if (!(*m_generator)( m_generator->m_current))
+            {
+                m_generator = nullptr;
+            }
+            return *this;
+        }
+
+        bool operator==( const iterator &other) const
+        {
+            return m_generator == other.m_generator;
+        }
+
+        bool operator!=( const iterator &other) const
+        {
+            return !(*this == other);
+        }
+
+    private:
+        Generator *m_generator = nullptr;
+    };
+
+    Generator() = default;
+
+    Generator( Function f)
+    :m_function{ std::move( f)}
+    {
+    }
+
+    /// Obtain the next value. Returns false if the sequence is exhausted.
+    bool operator()( T &value)
+    {
+        if (m_function && !m_function( value))
+        {
+            m_function = nullptr;
+        }
+        return static_cast<bool>( m_function);
+    }
+
+    iterator begin() { return iterator{ this};}
+    iterator end() { return iterator{};}
+
+private:
+    Function m_function;
+    T        m_current{};
+};
+
+/**
+ * Create a generator that produces the values of a container.
+ *
+ * The container is moved into the generator, which is useful to turn the
+ * result of an existing function into a stream.
+ */
+template< typename Container>
+Generator< typename Container::value_type> MakeGenerator( Container container)
+{
+    auto shared = std::make_shared<Container>( std::move( container));
+    auto current = shared->begin();
+    return Generator< typename Container::value_type>{
+        [shared, current]( typename Container::value_type &value) mutable
+        {
+            if (current == shared->end()) return false;
+            value = *current++;
+            return true;
+        }
+    };
+}
+
+#endif /* GENERATOR_HPP_ */
@@ -0,0 +1,901 @@
+//
+//  Copyright (C) 2017 Danny Havenith
+//
+//  Distributed under the Boost Software License, Version 1.0. (See
+//  accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt)
+//
+#ifndef IO_URING_TRANSPORT_HPP_
+#define IO_URING_TRANSPORT_HPP_
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define DEMORPC_HAS_IO_URING 1
+#endif
+#endif
+
+#ifdef DEMORPC_HAS_IO_URING
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+/**
+ * How a connection sends and receives its bytes.
+ */
+enum class Transport
+{
+    Asio,       ///< with the reactor of the io_service, which is epoll on Linux
+    IoUring     ///< with the io_uring that the connections of an io_service share, see IoUringTransport
+};
+
+/**
+ * Options of the io_uring of an io_service. They are used by the first connection
+ * that asks for the ring of its io_service.
+ */
+struct IoUringOptions
+{
+    /// The number of entries in the submission queue. The completion queue is eight times larger.
+    unsigned entries = 256;
+
+    /// The number of buffers that the kernel receives into, rounded up to a power of two,
+    /// and their size. Received bytes are copied out of these buffers right away.
+    unsigned buffers = 256;
+    unsigned bufferSize = 4096;
+
+    /// The number of bytes that a connection receives ahead of its reader. Beyond this,
+    /// the ring stops receiving on the connection until it is read from again, so that
+    /// the sender notices that it is not read from.
+    std::size_t maxUnread = 64 * 1024;
+
+    /// Let a kernel thread poll the submission queue (SQPOLL), so that submitting needs no
+    /// system call. That thread keeps a core busy while there is traffic and goes to sleep
+    /// after sqPollIdle without traffic. Without the privileges for this, the ring is
+    /// created without SQPOLL.
+    bool sqPoll = false;
+    std::chrono::milliseconds sqPollIdle{ 100};
+};
+
+#ifdef DEMORPC_HAS_IO_URING
+
+/**
+ * An io_uring that sends and receives on behalf of the connections of an io_service.
+ *
+ * Every connection has a receiver in the ring: a multishot receive that stays armed
+ * while the connection reads, and that lets the kernel pick a buffer from a ring of
+ * provided buffers for every chunk of bytes that arrives. Receiving then takes no
+ * system calls at all. Writes are submitted as one sendmsg operation per gather
+ * write, and all operations that handlers prepare during one turn of the io_service
+ * are submitted together, with a single system call, or none with SQPOLL.
+ *
+ * The ring notifies an eventfd of its completions, which the io_service waits for like
+ * for any other descriptor, so the ring works with io_service::run() and with busy
+ * polling alike. Completions are handled by whichever thread runs the io_service, and
+ * the ring can be used from any thread.
+ *
+ * This uses the system calls directly, without liburing. It needs Linux 6.0 or later
+ * for multishot receives; IoUringTransport::of() returns nullptr if the ring can not
+ * be set up at all.
+ */
+class IoUringTransport : public std::enable_shared_from_this<IoUringTransport>
+{
+public:
+    typedef std::vector<char> Blob;
+    typedef std::uint64_t ReceiverId;
+    typedef std::function<void (const boost::system::error_code &)> SendHandler;
+
+    IoUringTransport( const IoUringTransport &) = delete;
+    IoUringTransport &operator=( const IoUringTransport &) = delete;
+
+    ~IoUringTransport()
+    {
+        close_ring();
+        if (m_bufferRing) ::munmap( m_bufferRing, m_bufferCount * sizeof( io_uring_buf));
+        if (m_bufferMemory) ::munmap( m_bufferMemory, m_bufferCount * m_options.bufferSize);
+    }
+
+    /// The ring of an io_service, which is created with the given options on first use.
+    /// Returns nullptr if this system does not support io_uring.
+    static std::shared_ptr<IoUringTransport> of( boost::asio::io_service &io_service, const IoUringOptions &options);
+
+    /// Whether a kernel thread polls the submission queue.
+    bool sq_polling() const
+    {
+        return m_sqPoll;
+    }
+
+    /// Start keeping track of the bytes that a connected socket receives.
+    ReceiverId add_receiver( int socket)
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        const ReceiverId id = m_nextId++;
+        std::unique_ptr<Receiver> receiver{ new Receiver};
+        receiver->socket = socket;
+        m_receivers.emplace( id, std::move( receiver));
+        return id;
+    }
+
+    /**
+     * Take the bytes that the receiver has received so far, or the error that ended
+     * receiving. Returns false if there are neither, in which case ready is called once,
+     * from within the io_service, when there are. An empty ready function makes this a
+     * non-blocking check.
+     *
+     * The bytes are exchanged for the contents of data, which the receiver receives into
+     * next, so data should be empty.
+     */
+    bool receive( ReceiverId id, Blob &data, boost::system::error_code &error, std::function<void ()> ready)
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        const auto found = m_receivers.find( id);
+        if (found == m_receivers.end() || m_stopped)
+        {
+            error = boost::asio::error::operation_aborted;
+            return true;
+        }
+
+        Receiver &receiver = *found->second;
+        if (!receiver.data.empty())
+        {
+            data.swap( receiver.data);
+            return true;
+        }
+        if (receiver.error)
+        {
+            error = receiver.error;
+            return true;
+        }
+        if (!ready) return false;
+
+        if (!receiver.armed && !arm_locked( id, receiver))
+        {
+            error = boost::asio::error::no_buffer_space;
+            return true;
+        }
+        receiver.ready = std::move( ready);
+        return false;
+    }
+
+    /// Make a receive in progress fail with operation_aborted, and every receive after it.
+    void close_receiver( ReceiverId id)
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        const auto found = m_receivers.find( id);
+        if (found == m_receivers.end() || m_stopped) return;
+
+        Receiver &receiver = *found->second;
+        receiver.error = boost::asio::error::operation_aborted;
+        receiver.data.clear();
+        stop_receiving_locked( id, receiver);
+        if (receiver.ready)
+        {
+            m_io_service.post( std::move( receiver.ready));
+            receiver.ready = nullptr;
+        }
+    }
+
+    /// Stop keeping track of a receiver, without calling the ready function of a receive in progress.
+    void remove_receiver( ReceiverId id)
+    {
+        std::function<void ()> ready;
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        const auto found = m_receivers.find( id);
+        if (found == m_receivers.end()) return;
+
+        Receiver &receiver = *found->second;
+        ready.swap( receiver.ready);
+        if (receiver.armed && !m_stopped)
+        {
+            // the receive refers to the receiver until it has ended.
+            receiver.removed = true;
+            stop_receiving_locked( id, receiver);
+        }
+        else
+        {
+            m_receivers.erase( found);
+        }
+    }
+
+    /**
+     * Send the bytes of all buffers, which must stay valid until the handler is called.
+     * The handler is called from within the io_service when all bytes have been sent or
+     * when sending failed.
+     */
+    void send( int socket, const std::vector<boost::asio::const_buffer> &buffers, SendHandler handler)
+    {
+        std::unique_ptr<Send> send{ new Send};
+        send->socket = socket;
+        for (const auto &buffer : buffers)
+        {
+            send->buffers.push_back( iovec{ const_cast<void *>( buffer.data()), buffer.size()});
+        }
+
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        if (m_stopped)
+        {
+            m_io_service.post( std::bind( std::move( handler), boost::asio::error::operation_aborted));
+            return;
+        }
+
+        const std::uint64_t id = m_nextId++;
+        if (!prepare_send_locked( id, *send))
+        {
+            m_io_service.post( std::bind( std::move( handler), boost::asio::error::no_buffer_space));
+            return;
+        }
+        send->handler = std::move( handler);
+        m_sends.emplace( id, std::move( send));
+        ++m_inFlight;
+        wait_locked();
+    }
+
+    /// Stop handling completions and close the ring, because the io_service is being destroyed.
+    /// Pending handlers are destroyed without being called.
+    void shutdown()
+    {
+        std::vector<std::function<void ()>> ready;
+        std::vector<std::unique_ptr<Send>> sends;
+        std::unique_ptr<boost::asio::posix::stream_descriptor> event;
+
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        if (m_stopped) return;
+        m_stopped = true;
+        for (auto &receiver : m_receivers)
+        {
+            ready.push_back( std::move( receiver.second->ready));
+            receiver.second->ready = nullptr;
+        }
+        for (auto &send : m_sends) sends.push_back( std::move( send.second));
+        m_sends.clear();
+        event.swap( m_event);
+
+        // closing the ring cancels the operations in progress, which release their sockets.
+        close_ring();
+    }
+
+private:
+    /// Bytes that a socket receives.
+    struct Receiver
+    {
+        int                         socket = -1;
+        bool                        armed = false;      ///< whether a multishot receive is in progress
+        bool                        cancelling = false; ///< whether that receive is being cancelled
+        bool                        removed = false;    ///< whether to forget the receiver once its receive has ended
+        Blob                        data;               ///< received bytes that have not been taken yet
+        boost::system::error_code   error;              ///< why receiving ended for good
+        std::function<void ()>      ready;              ///< to call when there are bytes or an error to take
+    };
+
+    /// A gather write that is in progress.
+    struct Send
+    {
+        int                 socket = -1;
+        std::vector<iovec>  buffers;
+        std::size_t         first = 0;      ///< the first buffer that has not been sent completely
+        msghdr              message;
+        SendHandler         handler;
+    };
+
+    /// The kinds of operations, which are encoded in the lower bits of the user data of an entry.
+    enum Operation { receive_operation, send_operation, cancel_operation, operation_bits = 2 };
+
+    static std::uint64_t user_data( std::uint64_t id, Operation operation)
+    {
+        return id << operation_bits | operation;
+    }
+
+    IoUringTransport( boost::asio::io_service &io_service, const IoUringOptions &options)
+    : m_io_service( io_service), m_options( options)
+    {
+    }
+
+    static int enter( int ring, unsigned submit, unsigned complete, unsigned flags)
+    {
+        return static_cast<int>( ::syscall( __NR_io_uring_enter, ring, submit, complete, flags, nullptr, 0));
+    }
+
+    static int register_resource( int ring, unsigned opcode, void *argument, unsigned count)
+    {
+        return static_cast<int>( ::syscall( __NR_io_uring_register, ring, opcode, argument, count));
+    }
+
+    /// Set up the ring, its provided buffers and its eventfd. Returns false if any of those fails.
+    bool open()
+    {
+        io_uring_params parameters;
+        std::memset( &parameters, 0, sizeof parameters);
+        parameters.flags = IORING_SETUP_CQSIZE;
+        parameters.cq_entries = m_options.entries * 8;
+        if (m_options.sqPoll)
+        {
+            parameters.flags |= IORING_SETUP_SQPOLL;
+            parameters.sq_thread_idle = static_cast<unsigned>( m_options.sqPollIdle.count());
+            m_ring = static_cast<int>( ::syscall( __NR_io_uring_setup, m_options.entries, &parameters));
+            if (m_ring < 0)
+            {
+                parameters.flags &= ~IORING_SETUP_SQPOLL;
+                parameters.sq_thread_idle = 0;
+            }
+        }
+        if (m_ring < 0)
+        {
+            m_ring = static_cast<int>( ::syscall( __NR_io_uring_setup, m_options.entries, &parameters));
+        }
+        if (m_ring < 0) return false;
+        m_sqPoll = (parameters.flags & IORING_SETUP_SQPOLL) != 0;
+
+        // map the submission queue, the completion queue and the submission queue entries.
+        m_sqRingSize = parameters.sq_off.array + parameters.sq_entries * sizeof( unsigned);
+        m_cqRingSize = parameters.cq_off.cqes + parameters.cq_entries * sizeof( io_uring_cqe);
+        const bool single = (parameters.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single) m_sqRingSize = m_cqRingSize = std::max( m_sqRingSize, m_cqRingSize);
+
+        m_sqRing = map( m_sqRingSize, IORING_OFF_SQ_RING);
+        m_cqRing = single ? m_sqRing : map( m_cqRingSize, IORING_OFF_CQ_RING);
+        m_sqesSize = parameters.sq_entries * sizeof( io_uring_sqe);
+        m_sqes = static_cast<io_uring_sqe *>( map( m_sqesSize, IORING_OFF_SQES));
+        if (!m_sqRing || !m_cqRing || !m_sqes) return false;
+
+        char *sq = static_cast<char *>( m_sqRing);
+        m_sqHead = reinterpret_cast<unsigned *>( sq + parameters.sq_off.head);
+        m_sqTail = reinterpret_cast<unsigned *>( sq + parameters.sq_off.tail);
+        m_sqFlags = reinterpret_cast<unsigned *>( sq + parameters.sq_off.flags);
+        m_sqMask = *reinterpret_cast<unsigned *>( sq + parameters.sq_off.ring_mask);
+        m_sqEntries = parameters.sq_entries;
+        unsigned *array = reinterpret_cast<unsigned *>( sq + parameters.sq_off.array);
+        for (unsigned index = 0; index < m_sqEntries; ++index) array[index] = index;
+        m_sqeTail = *m_sqTail;
+
+        char *cq = static_cast<char *>( m_cqRing);
+        m_cqHead = reinterpret_cast<unsigned *>( cq + parameters.cq_off.head);
+        m_cqTail = reinterpret_cast<unsigned *>( cq + parameters.cq_off.tail);
+        m_cqMask = *reinterpret_cast<unsigned *>( cq + parameters.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<io_uring_cqe *>( cq + parameters.cq_off.cqes);
+
+        // register the ring of provided buffers and fill it.
+        m_bufferCount = 1;
+        while (m_bufferCount < std::min( std::max( m_options.buffers, 1u), 32768u)) m_bufferCount *= 2;
+        m_bufferRing = static_cast<io_uring_buf *>( map_anonymous( m_bufferCount * sizeof( io_uring_buf)));
+        m_bufferMemory = static_cast<char *>( map_anonymous( m_bufferCount * m_options.bufferSize));
+        if (!m_bufferRing || !m_bufferMemory) return false;
+
+        io_uring_buf_reg registration;
+        std::memset( &registration, 0, sizeof registration);
+        registration.ring_addr = reinterpret_cast<std::uint64_t>( m_bufferRing);
+        registration.ring_entries = m_bufferCount;
+        registration.bgid = buffer_group;
+        if (register_resource( m_ring, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) return false;
+        for (unsigned buffer = 0; buffer < m_bufferCount; ++buffer) provide_buffer_locked( buffer);
+        publish_buffers_locked();
+
+        // let the io_service wait for completions.
+        int event = ::eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (event < 0) return false;
+        m_event.reset( new boost::asio::posix::stream_descriptor( m_io_service, event));
+        return register_resource( m_ring, IORING_REGISTER_EVENTFD, &event, 1) == 0;
+    }
+
+    void *map( std::size_t size, std::uint64_t offset)
+    {
+        void *memory = ::mmap( nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring, static_cast<off_t>( offset));
+        return memory == MAP_FAILED ? nullptr : memory;
+    }
+
+    static void *map_anonymous( std::size_t size)
+    {
+        void *memory = ::mmap( nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return memory == MAP_FAILED ? nullptr : memory;
+    }
+
+    /// Close the ring and unmap its queues. The provided buffers stay mapped until destruction,
+    /// because the kernel may still be finishing operations.
+    void close_ring()
+    {
+        if (m_sqes) ::munmap( m_sqes, m_sqesSize);
+        if (m_cqRing && m_cqRing != m_sqRing) ::munmap( m_cqRing, m_cqRingSize);
+        if (m_sqRing) ::munmap( m_sqRing, m_sqRingSize);
+        m_sqes = nullptr;
+        m_sqRing = m_cqRing = nullptr;
+        if (m_ring >= 0) ::close( m_ring);
+        m_ring = -1;
+    }
+
+    /// Give a provided buffer back to the kernel. It sees the buffer once the tail is published.
+    void provide_buffer_locked( unsigned buffer)
+    {
+        io_uring_buf &entry = m_bufferRing[m_bufferTail & (m_bufferCount - 1)];
+        entry.addr = reinterpret_cast<std::uint64_t>( m_bufferMemory + std::size_t{ buffer} * m_options.bufferSize);
+        entry.len = m_options.bufferSize;
+        entry.bid = static_cast<std::uint16_t>( buffer);
+        ++m_bufferTail;
+    }
+
+    void publish_buffers_locked()
+    {
+        // the tail of the buffer ring overlays the reserved field of its first entry.
+        __atomic_store_n( &m_bufferRing[0].resv, m_bufferTail, __ATOMIC_RELEASE);
+    }
+
+    /// A free submission queue entry, or nullptr if the queue stays full.
+    io_uring_sqe *next_entry_locked()
+    {
+        if (m_ring < 0) return nullptr;
+        if (m_sqeTail - __atomic_load_n( m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries)
+        {
+            submit_locked();
+            if (m_sqPoll && m_sqeTail - __atomic_load_n( m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries)
+            {
+                enter( m_ring, 0, 0, IORING_ENTER_SQ_WAIT);
+            }
+            if (m_sqeTail - __atomic_load_n( m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries) return nullptr;
+        }
+
+        io_uring_sqe *entry = &m_sqes[m_sqeTail & m_sqMask];
+        std::memset( entry, 0, sizeof *entry);
+        ++m_sqeTail;
+        submit_later_locked();
+        return entry;
+    }
+
+    /// Start a multishot receive into the provided buffers.
+    bool arm_locked( ReceiverId id, Receiver &receiver)
+    {
+        io_uring_sqe *entry = next_entry_locked();
+        if (!entry) return false;
+
+        entry->opcode = IORING_OP_RECV;
+        entry->fd = receiver.socket;
+        entry->ioprio = IORING_RECV_MULTISHOT;
+        entry->flags = IOSQE_BUFFER_SELECT;
+        entry->buf_group = buffer_group;
+        entry->user_data = user_data( id, receive_operation);
+        receiver.armed = true;
+        ++m_inFlight;
+        wait_locked();
+        return true;
+    }
+
+    /// Cancel the multishot receive of a receiver, if it has one, and submit that right away.
+    void stop_receiving_locked( ReceiverId id, Receiver &receiver)
+    {
+        if (!receiver.armed || receiver.cancelling) return;
+        if (cancel_locked( id, receiver)) submit_locked();
+    }
+
+    bool cancel_locked( ReceiverId id, Receiver &receiver)
+    {
+        io_uring_sqe *entry = next_entry_locked();
+        if (!entry) return false;
+
+        entry->opcode = IORING_OP_ASYNC_CANCEL;
+        entry->addr = user_data( id, receive_operation);
+        entry->user_data = user_data( 0, cancel_operation);
+        receiver.cancelling = true;
+        ++m_inFlight;
+        wait_locked();
+        return true;
+    }
+
+    /// Prepare a sendmsg of the buffers that have not been sent yet.
+    bool prepare_send_locked( std::uint64_t id, Send &send)
+    {
+        io_uring_sqe *entry = next_entry_locked();
+        if (!entry) return false;
+
+        std::memset( &send.message, 0, sizeof send.message);
+        send.message.msg_iov = send.buffers.data() + send.first;
+        send.message.msg_iovlen = send.buffers.size() - send.first;
+        entry->opcode = IORING_OP_SENDMSG;
+        entry->fd = send.socket;
+        entry->addr = reinterpret_cast<std::uint64_t>( &send.message);
+        entry->len = 1;
+        entry->msg_flags = MSG_NOSIGNAL;
+        entry->user_data = user_data( id, send_operation);
+        return true;
+    }
+
+    /// Submit the prepared entries once the current handler has finished, so that the entries
+    /// that handlers prepare in one turn of the io_service are submitted together.
+    void submit_later_locked()
+    {
+        if (m_submitPosted || dispatching() == this || m_stopped) return;
+        m_submitPosted = true;
+        auto self = shared_from_this();
+        m_io_service.post( [self]()
+            {
+                {
+                    std::lock_guard<std::mutex> lock{ self->m_mutex};
+                    self->m_submitPosted = false;
+                }
+                self->handle_completions( false);
+            });
+    }
+
+    /// Make the prepared entries visible to the kernel and tell it to process them.
+    void submit_locked()
+    {
+        if (m_ring < 0 || m_sqeTail == *m_sqTail) return;
+        __atomic_store_n( m_sqTail, m_sqeTail, __ATOMIC_RELEASE);
+
+        if (m_sqPoll)
+        {
+            // the kernel thread only needs a wake-up if it went to sleep.
+            __atomic_thread_fence( __ATOMIC_SEQ_CST);
+            if (__atomic_load_n( m_sqFlags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+            {
+                enter( m_ring, 0, 0, IORING_ENTER_SQ_WAKEUP);
+            }
+            return;
+        }
+
+        for (;;)
+        {
+            const unsigned pending = m_sqeTail - __atomic_load_n( m_sqHead, __ATOMIC_ACQUIRE);
+            if (!pending) return;
+            if (enter( m_ring, pending, 0, 0) < 0 && errno != EINTR)
+            {
+                // the kernel is busy, for instance with completions that have not been
+                // handled yet. Try again after the next completions.
+                submit_later_locked();
+                return;
+            }
+        }
+    }
+
+    /// Let the io_service wait for completions, while there are operations in flight.
+    void wait_locked()
+    {
+        if (m_waiting || m_stopped || !m_inFlight) return;
+        m_waiting = true;
+        auto self = shared_from_this();
+        m_event->async_read_some( boost::asio::null_buffers(),
+            [self]( const boost::system::error_code &, std::size_t)
+            {
+                self->handle_completions( true);
+            });
+    }
+
+    /**
+     * Handle the completions that are there and call the handlers that they complete.
+     * Then submit the entries that those handlers prepared and handle the operations that
+     * complete right away, like most sends, until there are none.
+     *
+     * This is called when the eventfd reports completions, and when entries have been
+     * prepared outside of this function.
+     */
+    void handle_completions( bool notified)
+    {
+        struct Dispatching
+        {
+            explicit Dispatching( IoUringTransport *ring) : previous( dispatching()) { dispatching() = ring; }
+            ~Dispatching() { dispatching() = previous; }
+            IoUringTransport *previous;
+        } marker{ this};
+
+        std::vector<std::function<void ()>> handlers;
+        for (;;)
+        {
+            {
+                std::lock_guard<std::mutex> lock{ m_mutex};
+                if (m_stopped) return;
+                if (notified)
+                {
+                    // wait again before the eventfd is cleared, so that no completion goes unnoticed.
+                    m_waiting = notified = false;
+                    wait_locked();
+                    std::uint64_t count;
+                    while (::read( m_event->native_handle(), &count, sizeof count) < 0 && errno == EINTR) {}
+                }
+
+                submit_locked();
+                reap_locked( handlers);
+                wait_locked();
+                if (handlers.empty())
+                {
+                    if (!m_inFlight && m_waiting)
+                    {
+                        // nothing can complete anymore, so let io_service::run() return.
+                        boost::system::error_code ignored;
+                        m_event->cancel( ignored);
+                    }
+                    return;
+                }
+            }
+
+            for (auto &handler : handlers) handler();
+            handlers.clear();
+        }
+    }
+
+    void reap_locked( std::vector<std::function<void ()>> &handlers)
+    {
+        for (;;)
+        {
+            unsigned head = *m_cqHead;
+            const unsigned tail = __atomic_load_n( m_cqTail, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head)
+            {
+                complete_locked( m_cqes[head & m_cqMask], handlers);
+            }
+            __atomic_store_n( m_cqHead, head, __ATOMIC_RELEASE);
+
+            // completions that did not fit in the queue are only moved into it by a system call.
+            if (!(__atomic_load_n( m_sqFlags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW)) break;
+            enter( m_ring, 0, 0, IORING_ENTER_GETEVENTS);
+        }
+        publish_buffers_locked();
+    }
+
+    void complete_locked( const io_uring_cqe &completion, std::vector<std::function<void ()>> &handlers)
+    {
+        const std::uint64_t id = completion.user_data >> operation_bits;
+        switch (completion.user_data & ((1 << operation_bits) - 1))
+        {
+        case receive_operation:
+            complete_receive_locked( id, completion, handlers);
+            break;
+
+        case send_operation:
+            complete_send_locked( id, completion, handlers);
+            break;
+
+        default:
+            --m_inFlight;
+            break;
+        }
+    }
+
+    void complete_receive_locked( ReceiverId id, const io_uring_cqe &completion, std::vector<std::function<void ()>> &handlers)
+    {
+        const auto found = m_receivers.find( id);
+        Receiver *receiver = found == m_receivers.end() ? nullptr : found->second.get();
+
+        if (completion.flags & IORING_CQE_F_BUFFER)
+        {
+            const unsigned buffer = completion.flags >> IORING_CQE_BUFFER_SHIFT;
+            if (receiver && completion.res > 0 && !receiver->error && !receiver->removed)
+            {
+                const char *bytes = m_bufferMemory + std::size_t{ buffer} * m_options.bufferSize;
+                receiver->data.insert( receiver->data.end(), bytes, bytes + completion.res);
+            }
+            provide_buffer_locked( buffer);
+        }
+
+        if (!(completion.flags & IORING_CQE_F_MORE))
+        {
+            // the multishot receive has ended.
+            --m_inFlight;
+            if (!receiver) return;
+            receiver->armed = receiver->cancelling = false;
+            if (receiver->removed)
+            {
+                m_receivers.erase( found);
+                return;
+            }
+
+            if (completion.res == 0 && !receiver->error)
+            {
+                receiver->error = boost::asio::error::eof;
+            }
+            else if (completion.res < 0 && completion.res != -ENOBUFS && completion.res != -ECANCELED && !receiver->error)
+            {
+                receiver->error = boost::system::error_code( -completion.res, boost::asio::error::get_system_category());
+            }
+
+            // out of buffers or cancelled: receive again if the connection is waiting.
+            if (receiver->ready && receiver->data.empty() && !receiver->error && !arm_locked( id, *receiver))
+            {
+                receiver->error = boost::asio::error::no_buffer_space;
+            }
+        }
+
+        if (!receiver) return;
+        if (receiver->ready && (!receiver->data.empty() || receiver->error))
+        {
+            handlers.push_back( std::move( receiver->ready));
+            receiver->ready = nullptr;
+        }
+        else if (!receiver->ready && receiver->armed && !receiver->cancelling && receiver->data.size() >= m_options.maxUnread)
+        {
+            cancel_locked( id, *receiver);
+        }
+    }
+
+    void complete_send_locked( std::uint64_t id, const io_uring_cqe &completion, std::vector<std::function<void ()>> &handlers)
+    {
+        const auto found = m_sends.find( id);
+        if (found == m_sends.end()) return;
+        Send &send = *found->second;
+
+        boost::system::error_code error;
+        if (completion.res < 0)
+        {
+            error = boost::system::error_code( -completion.res, boost::asio::error::get_system_category());
+        }
+        else
+        {
+            // skip the bytes that were sent, and send the rest, if any.
+            std::size_t sent = static_cast<std::size_t>( completion.res);
+            while (send.first < send.buffers.size() && sent >= send.buffers[send.first].iov_len)
+            {
+                sent -= send.buffers[send.first++].iov_len;
+            }
+            if (send.first < send.buffers.size())
+            {
+                iovec &partial = send.buffers[send.first];
+                partial.iov_base = static_cast<char *>( partial.iov_base) + sent;
+                partial.iov_len -= sent;
+                if (completion.res > 0 && prepare_send_locked( id, send)) return;
+                error = completion.res > 0 ? boost::asio::error::no_buffer_space : boost::asio::error::broken_pipe;
+            }
+        }
+
+        --m_inFlight;
+        handlers.push_back( std::bind( std::move( send.handler), error));
+        m_sends.erase( found);
+    }
+
+    /// The ring whose completions the calling thread is handling, if any. Entries that are
+    /// prepared meanwhile are submitted when the handling has finished.
+    static IoUringTransport *&dispatching()
+    {
+        static thread_local IoUringTransport *ring = nullptr;
+        return ring;
+    }
+
+    /// The group id of the provided buffers.
+    enum { buffer_group = 0 };
+
+    boost::asio::io_service                 &m_io_service;
+    const IoUringOptions                    m_options;
+
+    /// Protects everything below, which is used by every thread that runs the io_service.
+    std::mutex                              m_mutex;
+    bool                                    m_stopped = false;
+    bool                                    m_waiting = false;      ///< whether the io_service waits for the eventfd
+    bool                                    m_submitPosted = false; ///< whether a submission has been posted
+    std::size_t                             m_inFlight = 0;         ///< operations that have not ended yet
+    std::uint64_t                           m_nextId = 1;
+    std::unordered_map<ReceiverId, std::unique_ptr<Receiver>>   m_receivers;
+    std::unordered_map<std::uint64_t, std::unique_ptr<Send>>    m_sends;
+    std::unique_ptr<boost::asio::posix::stream_descriptor>      m_event;
+
+    /// The ring and its memory mappings.
+    int                                     m_ring = -1;
+    bool                                    m_sqPoll = false;
+    void                                    *m_sqRing = nullptr;
+    void                                    *m_cqRing = nullptr;
+    std::size_t                             m_sqRingSize = 0;
+    std::size_t                             m_cqRingSize = 0;
+    io_uring_sqe                            *m_sqes = nullptr;
+    std::size_t                             m_sqesSize = 0;
+    unsigned                                *m_sqHead = nullptr;
+    unsigned                                *m_sqTail = nullptr;
+    unsigned                                *m_sqFlags = nullptr;
+    unsigned                                m_sqMask = 0;
+    unsigned                                m_sqEntries = 0;
+    unsigned                                m_sqeTail = 0;  ///< the tail, including the entries that have not been submitted
+    unsigned                                *m_cqHead = nullptr;
+    unsigned                                *m_cqTail = nullptr;
+    unsigned                                m_cqMask = 0;
+    io_uring_cqe                            *m_cqes = nullptr;
+
+    /// The provided buffers: a ring of buffer descriptions and the memory of the buffers.
+    io_uring_buf                            *m_bufferRing = nullptr;
+    char                                    *m_bufferMemory = nullptr;
+    unsigned                                m_bufferCount = 0;
+    std::uint16_t                           m_bufferTail = 0;
+
+    template <typename> friend class basic_io_uring_service;
+};
+
+/**
+ * Holds the IoUringTransport of an io_service, and shuts it down when the io_service
+ * is destroyed. The template parameter only serves to define the service id in a header.
+ */
+template <typename Unused = void>
+class basic_io_uring_service : public boost::asio::io_service::service
+{
+public:
+    static boost::asio::io_service::id id;
+
+    explicit basic_io_uring_service( boost::asio::io_service &io_service)
+    : boost::asio::io_service::service( io_service), m_io_service( io_service)
+    {
+    }
+
+    std::shared_ptr<IoUringTransport> transport( const IoUringOptions &options)
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        if (!m_created)
+        {
+            m_created = true;
+            std::shared_ptr<IoUringTransport> transport{ new IoUringTransport{ m_io_service, options}};
+            if (transport->open()) m_transport = transport;
+        }
+        return m_transport;
+    }
+
+    void shutdown()
+    {
+        std::shared_ptr<IoUringTransport> transport;
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex};
+            transport = m_transport;
+        }
+        if (transport) transport->shutdown();
+    }
+
+    /// The name of shutdown() in older versions of boost.
+    void shutdown_service()
+    {
+        shutdown();
+    }
+
+private:
+    boost::asio::io_service             &m_io_service;
+    std::mutex                          m_mutex;
+    bool                                m_created = false;
+    std::shared_ptr<IoUringTransport>   m_transport;
+};
+
+template <typename Unused>
+boost::asio::io_service::id basic_io_uring_service<Unused>::id;
+
+typedef basic_io_uring_service<> IoUringService;
+
+inline std::shared_ptr<IoUringTransport> IoUringTransport::of( boost::asio::io_service &io_service, const IoUringOptions &options)
+{
+    return boost::asio::use_service<IoUringService>( io_service).transport( options);
+}
+
+#else
+
+/**
+ * Stands in for the io_uring transport on platforms that do not have it: there never
+ * is a ring, so connections keep using the reactor of their io_service.
+ */
+class IoUringTransport
+{
+public:
+    typedef std::vector<char> Blob;
+    typedef std::uint64_t ReceiverId;
+    typedef std::function<void (const boost::system::error_code &)> SendHandler;
+
+    static std::shared_ptr<IoUringTransport> of( boost::asio::io_service &, const IoUringOptions &)
+    {
+        return nullptr;
+    }
+
+    bool sq_polling() const { return false; }
+    ReceiverId add_receiver( int) { return 0; }
+    bool receive( ReceiverId, Blob &, boost::system::error_code &error, std::function<void ()>)
+    {
+        error = boost::asio::error::operation_not_supported;
+        return true;
+    }
+    void close_receiver( ReceiverId) {}
+    void remove_receiver( ReceiverId) {}
+    void send( int, const std::vector<boost::asio::const_buffer> &, SendHandler) {}
+};
+
+#endif // DEMORPC_HAS_IO_URING
+
+#endif /* IO_URING_TRANSPORT_HPP_ */
@@ -0,0 +1,108 @@
+//
+//  Copyright (C) 2017 Danny Havenith
+//
+//  Distributed under the Boost Software License, Version 1.0. (See
+//  accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt)
+//
+#ifndef LATENCY_HISTOGRAM_HPP_
+#define LATENCY_HISTOGRAM_HPP_
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+/**
+ * Histogram of durations with a bounded relative error.
+ *
+ * Durations are recorded in microseconds. Each power of two is divided into
+ * a fixed number of sub-buckets, so that the reported percentiles are accurate
+ * to within about 12%, while the histogram itself has a fixed, small size.
+ */
+class LatencyHistogram
+{
+public:
+    typedef std::chrono::microseconds Duration;
+
+    template< typename Rep, typename Period>
+    void record( std::chrono::duration<Rep, Period> duration)
+    {
+        const auto us = std::chrono::duration_cast<Duration>( duration).count();
+        const std::uint64_t value = us < 0 ? 0 : static_cast<std::uint64_t>( us);
+
+        ++m_buckets[ bucket_of( value)];
+        ++m_count;
+        m_sum += value;
+        m_max = std::max( m_max, value);
+    }
+
+    std::uint64_t count() const { return m_count;}
+
+    Duration max() const { return Duration( m_max);}
+
+    Duration mean() const
+    {
+        return Duration( m_count ? m_sum / m_count : 0);
+    }
+
+    /// Return the duration below which the given fraction (0..1) of the recorded durations lie.
+    Duration percentile( double fraction) const
+    {
+        if (!m_count) return Duration( 0);
+
+        const auto rank = static_cast<std::uint64_t>( fraction * (m_count - 1)) + 1;
+        std::uint64_t seen = 0;
+        for (std::size_t bucket = 0; bucket < m_buckets.size(); ++bucket)
+        {
+            seen += m_buckets[bucket];
+            if (seen >= rank)
+            {
+                return Duration( std::min( upper_bound_of( bucket), m_max));
+            }
+        }
+        return max();
+    }
+
+    /// Add the durations recorded by another histogram to this one.
+    LatencyHistogram &operator+=( const LatencyHistogram &other)
+    {
+        for (std::size_t bucket = 0; bucket < m_buckets.size(); ++bucket)
+        {
+            m_buckets[bucket] += other.m_buckets[bucket];
+        }
+        m_count += other.m_count;
+        m_sum += other.m_sum;
+        m_max = std::max( m_max, other.m_max);
+        return *this;
+    }
+
+private:
+    enum { sub_bucket_bits = 3, sub_buckets = 1 << sub_bucket_bits, magnitudes = 64 - sub_bucket_bits + 1};
+
+    /// Values below sub_buckets are counted exactly, larger values by their most significant bits.
+    static std::size_t bucket_of( std::uint64_t value)
+    {
+        if (value < sub_buckets) return value;
+
+        unsigned magnitude = 0;
+        while ((value >> magnitude) >= 2 * sub_buckets) ++magnitude;
+        return (magnitude + 1) * sub_buckets + ((value >> magnitude) - sub_buckets);
+    }
+
+    static std::uint64_t upper_bound_of( std::size_t bucket)
+    {
+        if (bucket < sub_buckets) return bucket;
+
+        const auto magnitude = bucket / sub_buckets - 1;
+        const auto mantissa = bucket % sub_buckets + sub_buckets;
+        return ((mantissa + 1) << magnitude) - 1;
+    }
+
+    std::array<std::uint64_t, magnitudes * sub_buckets> m_buckets{};
+    std::uint64_t m_count = 0;
+    std::uint64_t m_sum = 0;
+    std::uint64_t m_max = 0;
+};
+
+#endif /* LATENCY_HISTOGRAM_HPP_ */
@@ -0,0 +1,206 @@
+//
+//  Copyright (C) 2017 Danny Havenith
+//
+//  Distributed under the Boost Software License, Version 1.0. (See
+//  accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt)
+//
+#ifndef LOW_LATENCY_HPP_
+#define LOW_LATENCY_HPP_
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#endif
+
+/**
+ * Socket options of a connection.
+ *
+ * The defaults leave the operating system defaults alone. LowLatency() returns
+ * options for small request/reply messages, which should not wait for Nagle's
+ * algorithm or delayed acknowledgements.
+ */
+struct SocketOptions
+{
+    /// Send small messages right away instead of waiting for more data (TCP_NODELAY).
+    bool noDelay = false;
+
+    /// Acknowledge received data right away (TCP_QUICKACK). Linux only; the kernel
+    /// turns this off again after a while, so it is renewed after every receive.
+    bool quickAck = false;
+
+    /// The size of the kernel send buffer in bytes (SO_SNDBUF), or 0 for the default.
+    int sendBufferSize = 0;
+
+    /// The size of the kernel receive buffer in bytes (SO_RCVBUF), or 0 for the default.
+    int receiveBufferSize = 0;
+
+    static SocketOptions LowLatency()
+    {
+        SocketOptions options;
+        options.noDelay = true;
+        options.quickAck = true;
+        return options;
+    }
+};
+
+/**
+ * Apply socket options to a connected socket. Options that the platform does not
+ * support are ignored, as are errors, because none of the options are essential.
+ */
+inline void ApplySocketOptions( boost::asio::ip::tcp::socket &socket, const SocketOptions &options)
+{
+    boost::system::error_code ignored;
+    if (options.noDelay)
+    {
+        socket.set_option( boost::asio::ip::tcp::no_delay( true), ignored);
+    }
+    if (options.sendBufferSize)
+    {
+        socket.set_option( boost::asio::socket_base::send_buffer_size( options.sendBufferSize), ignored);
+    }
+    if (options.receiveBufferSize)
+    {
+        socket.set_option( boost::asio::socket_base::receive_buffer_size( options.receiveBufferSize), ignored);
+    }
+}
+
+/// Ask the kernel to acknowledge received data right away. This does nothing on other platforms than Linux.
+inline void RenewQuickAck( boost::asio::ip::tcp::socket &socket)
+{
+#ifdef TCP_QUICKACK
+    int on = 1;
+    ::setsockopt( socket.native_handle(), IPPROTO_TCP, TCP_QUICKACK, &on, sizeof on);
+#else
+    (void)socket;
+#endif
+}
+
+/**
+ * How a busy-polling event loop waits when there is nothing to do.
+ *
+ * The loop first spins, then yields the processor to other threads and finally
+ * sleeps for increasing periods, up to a maximum. Spinning gives the lowest
+ * latency, but keeps a core busy all the time.
+ */
+struct BusyPollOptions
+{
+    /// The number of times to poll without pause before starting to yield.
+    unsigned spins = 10000;
+
+    /// The number of times to poll and yield before starting to sleep.
+    unsigned yields = 1000;
+
+    /// The longest time to sleep between polls. Zero means: never sleep, keep yielding.
+    std::chrono::microseconds maxSleep = std::chrono::microseconds( 0);
+};
+
+/**
+ * Keeps track of the number of polls that found no work and pauses accordingly.
+ */
+class BusyPollBackoff
+{
+public:
+    explicit BusyPollBackoff( const BusyPollOptions &options)
+    : m_options( options)
+    {
+    }
+
+    /// A poll found work, start spinning again.
+    void reset()
+    {
+        m_idlePolls = 0;
+    }
+
+    /// A poll found no work, pause before the next poll.
+    void idle()
+    {
+        ++m_idlePolls;
+        if (m_idlePolls <= m_options.spins)
+        {
+            relax();
+        }
+        else if (m_idlePolls <= m_options.spins + m_options.yields
+                 || m_options.maxSleep == std::chrono::microseconds::zero())
+        {
+            std::this_thread::yield();
+        }
+        else
+        {
+            // double the sleep with every idle poll, until the maximum.
+            const auto doublings = std::min<unsigned>( m_idlePolls - m_options.spins - m_options.yields, 20);
+            std::this_thread::sleep_for( std::min( std::chrono::microseconds( 1 << doublings), m_options.maxSleep));
+        }
+    }
+
+private:
+    /// Tell the processor that this is a spin loop.
+    static void relax()
+    {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        __builtin_ia32_pause();
+#endif
+    }
+
+    const BusyPollOptions   m_options;
+    unsigned                m_idlePolls = 0;
+};
+
+/**
+ * Run an io_service by polling it in a loop, instead of letting the thread sleep
+ * in the operating system until there is work.
+ *
+ * This avoids the latency of waking up a thread, at the cost of processor time.
+ * Like io_service::run(), this returns when the io_service is stopped or runs out of
+ * work, and returns the number of handlers that were run.
+ */
+inline std::size_t RunBusyPolling(
+    boost::asio::io_service &io_service,
+    const BusyPollOptions &options = BusyPollOptions{})
+{
+    BusyPollBackoff backoff{ options};
+    std::size_t handlers = 0;
+    while (!io_service.stopped())
+    {
+        const auto count = io_service.poll();
+        if (count)
+        {
+            handlers += count;
+            backoff.reset();
+        }
+        else
+        {
+            backoff.idle();
+        }
+    }
+    return handlers;
+}
+
+/**
+ * Pin the calling thread to a processor core, so that it does not migrate and
+ * keeps its caches warm. Returns false if that is not possible, which is always
+ * the case on other platforms than Linux.
+ */
+inline bool PinThreadToCore( unsigned core)
+{
+#ifdef __linux__
+    cpu_set_t cores;
+    CPU_ZERO( &cores);
+    CPU_SET( core, &cores);
+    return pthread_setaffinity_np( pthread_self(), sizeof cores, &cores) == 0;
+#else
+    (void)core;
+    return false;
+#endif
+}
+
+#endif /* LOW_LATENCY_HPP_ */
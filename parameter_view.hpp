@@ -0,0 +1,255 @@
+//
+//  Copyright (C) 2017 Danny Havenith
+//
+//  Distributed under the Boost Software License, Version 1.0. (See
+//  accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt)
+//
+#ifndef PARAMETER_VIEW_HPP_
+#define PARAMETER_VIEW_HPP_
+
+#include <boost/archive/archive_exception.hpp>
+#include <boost/archive/binary_iarchive.hpp>
+#include <boost/serialization/collection_size_type.hpp>
+#include <boost/serialization/level.hpp>
+#include <boost/serialization/split_free.hpp>
+#include <boost/serialization/tracking.hpp>
+#include <cstddef>
+#include <istream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+#if __cplusplus > 201703L && defined(__has_include)
+#if __has_include(<span>)
+#include <span>
+#define PARAMETER_VIEW_STD_SPAN
+#endif
+#endif
+
+#include "blob.hpp"
+
+/**
+ * Read-only views as function parameters.
+ *
+ * A function that takes a StringView or a BlobView instead of a std::string or
+ * a Blob receives a view on the bytes in the parameter blob of the call, so
+ * that large arguments are not copied before the function is called. The view
+ * is only valid during the call: a function must copy the data if it needs to
+ * keep it.
+ *
+ * On the wire, a StringView is the same as a std::string and a BlobView is the
+ * same as a Blob, so a client may just as well send those.
+ *
+ * StringView is std::string_view in C++17 and BlobView is std::span<const Byte>
+ * in C++20. Older compilers get minimal classes of their own.
+ */
+#if __cplusplus >= 201703L
+
+using StringView = std::string_view;
+
+#else
+
+class StringView
+{
+public:
+    StringView() = default;
+
+    StringView( const char *data, std::size_t size)
+    : m_data( data), m_size( size)
+    {
+    }
+
+    StringView( const std::string &string)
+    : m_data( string.data()), m_size( string.size())
+    {
+    }
+
+    StringView( const char *string)
+    : m_data( string), m_size( std::char_traits<char>::length( string))
+    {
+    }
+
+    const char *data() const { return m_data; }
+    std::size_t size() const { return m_size; }
+    bool empty() const { return !m_size; }
+    const char *begin() const { return m_data; }
+    const char *end() const { return m_data + m_size; }
+    char operator[]( std::size_t index) const { return m_data[index]; }
+
+    explicit operator std::string() const
+    {
+        return std::string( m_data, m_size);
+    }
+
+    friend bool operator==( StringView left, StringView right)
+    {
+        return left.m_size == right.m_size
+            && std::char_traits<char>::compare( left.m_data, right.m_data, left.m_size) == 0;
+    }
+
+    friend bool operator!=( StringView left, StringView right)
+    {
+        return !(left == right);
+    }
+
+private:
+    const char  *m_data = nullptr;
+    std::size_t m_size = 0;
+};
+
+#endif
+
+#ifdef PARAMETER_VIEW_STD_SPAN
+
+using BlobView = std::span<const Byte>;
+
+#else
+
+class BlobView
+{
+public:
+    BlobView() = default;
+
+    BlobView( const Byte *data, std::size_t size)
+    : m_data( data), m_size( size)
+    {
+    }
+
+    BlobView( const Blob &blob)
+    : m_data( blob.data()), m_size( blob.size())
+    {
+    }
+
+    const Byte *data() const { return m_data; }
+    std::size_t size() const { return m_size; }
+    bool empty() const { return !m_size; }
+    const Byte *begin() const { return m_data; }
+    const Byte *end() const { return m_data + m_size; }
+    Byte operator[]( std::size_t index) const { return m_data[index]; }
+
+private:
+    const Byte  *m_data = nullptr;
+    std::size_t m_size = 0;
+};
+
+#endif
+
+/// Whether a parameter type is a view on the parameter blob.
+template<typename Type>
+struct IsParameterView : std::integral_constant<bool,
+        std::is_same<typename std::decay<Type>::type, StringView>::value
+        || std::is_same<typename std::decay<Type>::type, BlobView>::value>
+{
+};
+
+/// Whether any of the parameter types is a view on the parameter blob.
+template<typename... Types>
+struct HasParameterView : std::false_type
+{
+};
+
+template<typename First, typename... Rest>
+struct HasParameterView<First, Rest...> : std::integral_constant<bool,
+        IsParameterView<First>::value || HasParameterView<Rest...>::value>
+{
+};
+
+/**
+ * Archive that de-serializes the parameters of a call from a parameter blob.
+ *
+ * Besides what a binary_iarchive does, this lets parameter views point into
+ * the blob. The stream must read from the blob, as a boost::iostreams stream
+ * on an array_source does.
+ */
+class ParameterArchive : public boost::archive::binary_iarchive
+{
+public:
+    ParameterArchive( std::istream &stream, const Blob &parameters)
+    : binary_iarchive( stream), m_stream( stream), m_parameters( parameters)
+    {
+    }
+
+    /// Return a pointer to the next size bytes in the blob and skip them.
+    const Byte *take( std::size_t size)
+    {
+        const std::streamoff position = m_stream.tellg();
+        if (position < 0 || static_cast<std::size_t>( position) > m_parameters.size()
+            || size > m_parameters.size() - position)
+        {
+            throw boost::archive::archive_exception( boost::archive::archive_exception::input_stream_error);
+        }
+        m_stream.seekg( size, std::ios_base::cur);
+        return m_parameters.data() + position;
+    }
+
+private:
+    std::istream    &m_stream;
+    const Blob      &m_parameters;
+};
+
+/// Return the bytes of a view that is being de-serialized. Views can only be
+/// de-serialized from a ParameterArchive.
+template<typename Archive>
+const Byte *TakeViewBytes( Archive &ar, std::size_t size)
+{
+    auto parameters = dynamic_cast<ParameterArchive *>( &ar);
+    if (!parameters)
+    {
+        throw boost::archive::archive_exception( boost::archive::archive_exception::other_exception);
+    }
+    return parameters->take( size);
+}
+
+namespace boost {
+namespace serialization {
+
+template<typename Archive>
+void save( Archive &ar, const StringView &view, const unsigned int)
+{
+    // the same as a std::string
+    const std::size_t size = view.size();
+    ar << size;
+    ar.save_binary( view.data(), size);
+}
+
+template<typename Archive>
+void load( Archive &ar, StringView &view, const unsigned int)
+{
+    std::size_t size;
+    ar >> size;
+    view = StringView{ TakeViewBytes( ar, size), size};
+}
+
+template<typename Archive>
+void save( Archive &ar, const BlobView &view, const unsigned int)
+{
+    // the same as a Blob
+    const collection_size_type count( view.size());
+    ar << count;
+    ar.save_binary( view.data(), view.size());
+}
+
+template<typename Archive>
+void load( Archive &ar, BlobView &view, const unsigned int)
+{
+    collection_size_type count;
+    ar >> count;
+    view = BlobView{ TakeViewBytes( ar, count), count};
+}
+
+}
+}
+
+BOOST_SERIALIZATION_SPLIT_FREE( StringView)
+BOOST_CLASS_IMPLEMENTATION( StringView, boost::serialization::object_serializable)
+BOOST_CLASS_TRACKING( StringView, boost::serialization::track_never)
+
+BOOST_SERIALIZATION_SPLIT_FREE( BlobView)
+BOOST_CLASS_IMPLEMENTATION( BlobView, boost::serialization::object_serializable)
+BOOST_CLASS_TRACKING( BlobView, boost::serialization::track_never)
+
+#endif /* PARAMETER_VIEW_HPP_ */
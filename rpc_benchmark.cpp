@@ -0,0 +1,289 @@
+//
+//  Copyright (C) 2017 Danny Havenith
+//
+//  Distributed under the Boost Software License, Version 1.0. (See
+//  accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Measure the latency and the throughput of small calls.
+//
+// usage: rpc_benchmark [options] [host port]
+//
+// options:
+//   --calls <n>        the number of calls of each measurement (20000)
+//   --depth <n>        the number of pipelined calls in flight per connection (128)
+//   --connections <n>  the number of connections of the pipelined measurement (1)
+//   --threads <n>      the number of threads that run the service (1)
+//   --low-latency      set SocketOptions::LowLatency() on the service and the client
+//   --busy-poll        let the service threads and the client busy poll instead of sleeping;
+//                      this needs a free core for every thread, or the threads starve each other
+//   --pin <core>       pin the client thread to a core and the service threads to the next cores
+//   --transport <name> asio (the default) or io_uring, for the service and the client; both
+//                      fall back to asio if io_uring is not available
+//   --sqpoll           let a kernel thread submit the io_uring operations (SQPOLL); like
+//                      --busy-poll, this needs a free core for that thread
+//
+// Without a host and port, the benchmark starts a service of its own. Two
+// measurements are made:
+// - sequential: one call at a time, so every call pays the full round trip. This
+//   shows the latency of the transport.
+// - pipelined: up to the pipeline depth of calls in flight on every connection.
+//   This shows how many calls per second the transport can carry, which depends
+//   mostly on the number of system calls per message. With several connections
+//   and service threads, it also exercises the service under concurrency.
+// Both use the "add" function of demo_functions.hpp, so a demo_rpc server can be
+// measured as well.
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "binary_function_marshaller.hpp"
+#include "binary_function_wrapper.hpp"
+#include "demo_functions.hpp"
+#include "latency_histogram.hpp"
+#include "rpc_proxy.hpp"
+#include "rpc_service.hpp"
+
+namespace
+{
+    typedef RpcProxy::Clock Clock;
+
+    struct Options
+    {
+        unsigned    calls = 20000;
+        unsigned    depth = 128;
+        unsigned    connections = 1;
+        unsigned    threads = 1;
+        bool        lowLatency = false;
+        bool        busyPoll = false;
+        bool        pinned = false;
+        unsigned    core = 0;
+        Transport   transport = Transport::Asio;
+        bool        sqPoll = false;
+        std::string host;
+        std::string port;
+    };
+
+    bool ParseOptions( int argc, const char *argv[], Options &options)
+    {
+        std::vector<std::string> positional;
+        for (int index = 1; index < argc; ++index)
+        {
+            const std::string argument = argv[index];
+            const bool hasValue = index + 1 < argc;
+            auto number = [&]() { return static_cast<unsigned>( std::max( 1, std::atoi( argv[++index])));};
+
+            if (argument == "--calls" && hasValue) options.calls = number();
+            else if (argument == "--depth" && hasValue) options.depth = number();
+            else if (argument == "--connections" && hasValue) options.connections = number();
+            else if (argument == "--threads" && hasValue) options.threads = number();
+            else if (argument == "--low-latency") options.lowLatency = true;
+            else if (argument == "--busy-poll") options.busyPoll = true;
+            else if (argument == "--transport" && hasValue)
+            {
+                const std::string name = argv[++index];
+                if (name == "io_uring") options.transport = Transport::IoUring;
+                else if (name != "asio") return false;
+            }
+            else if (argument == "--sqpoll") options.sqPoll = true;
+            else if (argument == "--pin" && hasValue)
+            {
+                options.pinned = true;
+                options.core = static_cast<unsigned>( std::max( 0, std::atoi( argv[++index])));
+            }
+            else if (argument.compare( 0, 2, "--") == 0) return false;
+            else positional.push_back( argument);
+        }
+
+        if (positional.size() == 2)
+        {
+            options.host = positional[0];
+            options.port = positional[1];
+        }
+        return positional.empty() || positional.size() == 2;
+    }
+
+    void report( const std::string &name, const LatencyHistogram &latencies, Clock::duration duration)
+    {
+        const double seconds = std::chrono::duration<double>( duration).count();
+        std::cout << name << ": " << latencies.count() << " calls in " << seconds << " s, "
+            << (seconds > 0 ? latencies.count() / seconds : 0) << " calls/s\n";
+        std::cout << "    latency: mean " << latencies.mean().count()
+            << " us, p50 " << latencies.percentile( .5).count()
+            << " us, p99 " << latencies.percentile( .99).count()
+            << " us, max " << latencies.max().count() << " us\n";
+    }
+
+    /// Make calls one after the other.
+    void sequential( RpcProxy &proxy, unsigned calls)
+    {
+        auto remoteAdd = CreateProxyFunction( add, proxy, "add");
+
+        LatencyHistogram latencies;
+        const auto start = Clock::now();
+        for (unsigned call = 0; call < calls; ++call)
+        {
+            const auto sent = Clock::now();
+            if (remoteAdd( static_cast<int>( call), 1) != static_cast<int>( call) + 1)
+            {
+                throw std::runtime_error( "wrong result");
+            }
+            latencies.record( Clock::now() - sent);
+        }
+        report( "sequential", latencies, Clock::now() - start);
+    }
+
+    /**
+     * Keeps a number of calls in flight on every connection until all calls have been made.
+     */
+    class Pipeline
+    {
+    public:
+        Pipeline( std::vector<std::unique_ptr<RpcProxy>> &proxies, unsigned calls, unsigned depth)
+        : m_proxies( proxies), m_calls( calls), m_depth( depth), m_parameters( MarshalParameters( 1, 2))
+        {
+        }
+
+        void run( boost::asio::io_service &io_service, bool busyPoll)
+        {
+            m_start = Clock::now();
+            for (auto &proxy : m_proxies)
+            {
+                for (unsigned count = 0; count < m_depth && m_sent < m_calls; ++count) send( *proxy);
+            }
+            if (busyPoll)
+            {
+                RunBusyPolling( io_service);
+            }
+            else
+            {
+                io_service.run();
+            }
+            report( "pipelined", m_latencies, Clock::now() - m_start);
+            if (m_errors) std::cout << "    errors: " << m_errors << '\n';
+        }
+
+    private:
+        void send( RpcProxy &proxy)
+        {
+            ++m_sent;
+            const auto sent = Clock::now();
+            proxy.async_call( "add", m_parameters, Clock::duration::zero(),
+                [this, &proxy, sent]( const boost::system::error_code &e, RpcReply &reply)
+                {
+                    if (e || std::get<1>( reply) != ReplyType::Result)
+                    {
+                        ++m_errors;
+                    }
+                    else
+                    {
+                        m_latencies.record( Clock::now() - sent);
+                    }
+
+                    if (m_sent < m_calls)
+                    {
+                        send( proxy);
+                    }
+                    else if (m_latencies.count() + m_errors == m_calls)
+                    {
+                        for (auto &proxy : m_proxies) proxy->close();
+                    }
+                });
+        }
+
+        std::vector<std::unique_ptr<RpcProxy>>  &m_proxies;
+        const unsigned                          m_calls;
+        const unsigned                          m_depth;
+        const Blob                              m_parameters;
+
+        Clock::time_point                       m_start;
+        unsigned                                m_sent = 0;
+        unsigned                                m_errors = 0;
+        LatencyHistogram                        m_latencies;
+    };
+}
+
+int main( int argc, const char *argv[])
+{
+    Options options;
+    if (!ParseOptions( argc, argv, options))
+    {
+        std::cerr << "usage: " << argv[0]
+            << " [--calls n] [--depth n] [--connections n] [--threads n]"
+            << " [--low-latency] [--busy-poll] [--pin core] [--transport asio|io_uring] [--sqpoll]"
+            << " [host port]\n";
+        return 1;
+    }
+
+    const SocketOptions socketOptions = options.lowLatency ? SocketOptions::LowLatency() : SocketOptions{};
+    IoUringOptions ioUringOptions;
+    ioUringOptions.sqPoll = options.sqPoll;
+    if (options.pinned && !PinThreadToCore( options.core))
+    {
+        std::cerr << "could not pin the client to core " << options.core << '\n';
+    }
+
+    // run a service of our own, unless one was given.
+    const unsigned short port = 65431;
+    boost::asio::io_service serviceIo;
+    std::unique_ptr<RpcService> service;
+    std::thread serviceThread;
+    if (options.host.empty())
+    {
+        service.reset( new RpcService{ serviceIo, port});
+        service->register_function( "add", add);
+        service->set_socket_options( socketOptions);
+        if (!service->set_transport( options.transport, ioUringOptions))
+        {
+            std::cerr << "io_uring is not available, the service uses asio\n";
+        }
+
+        RpcServiceThreads threads;
+        threads.threads = options.threads;
+        threads.busyPolling = options.busyPoll;
+        threads.pinned = options.pinned;
+        threads.firstCore = options.core + 1;
+        serviceThread = std::thread( [&service, threads]() { service->run( threads); });
+
+        options.host = "localhost";
+        options.port = std::to_string( port);
+    }
+
+    int result = 0;
+    try
+    {
+        boost::asio::io_service io_service;
+        std::vector<std::unique_ptr<RpcProxy>> proxies;
+        for (unsigned count = 0; count < options.connections; ++count)
+        {
+            proxies.emplace_back( new RpcProxy{ io_service, options.host, options.port});
+            proxies.back()->set_socket_options( socketOptions);
+            proxies.back()->set_busy_polling( options.busyPoll);
+            if (!proxies.back()->set_transport( options.transport, ioUringOptions) && count == 0)
+            {
+                std::cerr << "io_uring is not available, the client uses asio\n";
+            }
+        }
+        sequential( *proxies.front(), options.calls);
+
+        io_service.reset();
+        Pipeline pipeline{ proxies, options.calls, options.depth};
+        pipeline.run( io_service, options.busyPoll);
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "benchmark failed: " << e.what() << '\n';
+        result = 1;
+    }
+
+    serviceIo.stop();
+    if (serviceThread.joinable()) serviceThread.join();
+    return result;
+}
@@ -8,10 +8,35 @@
 #ifndef RPC_MESSAGE_HPP_
 #define RPC_MESSAGE_HPP_
 
-#include "blob.hpp"
+#include <cstdint>
+#include <string>
 #include <tuple>
+#include <vector>
+#include "blob.hpp"
+
+/// Identifies a call on a connection. Every reply frame carries the id of the call it belongs to.
+typedef std::uint32_t RequestId;
+
+/**
+ * The time that the client is prepared to wait for a call, in microseconds.
+ *
+ * The timeout is relative, because client and server clocks need not agree: the
+ * server derives the deadline from the moment it received the message. Zero
+ * means that the call has no deadline.
+ */
+typedef std::uint64_t TimeoutMicroseconds;
+
+/// The kind of frame that is sent back to the client.
+enum class ReplyType : std::uint8_t
+{
+    Result,         ///< the single result of a regular function
+    StreamItem,     ///< one value of a streaming function; more frames follow
+    StreamEnd,      ///< a streaming function has produced all of its values
+    Error,          ///< the call failed, the blob holds the error message
+    Overloaded      ///< the server refused the call because it has too much work
+};
 
-typedef std::tuple<std::string, Blob> RpcMessage;
-typedef Blob RpcReply;
+typedef std::tuple<RequestId, TimeoutMicroseconds, std::string, Blob> RpcMessage;
+typedef std::tuple<RequestId, ReplyType, Blob> RpcReply;
 
 #endif /* RPC_MESSAGE_HPP_ */
@@ -10,11 +10,23 @@
 #include "connection.hpp"
 
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/bind.hpp>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <vector>
 #include <boost/serialization/vector.hpp>
 #include "connection.hpp" // Must come before boost/serialization headers.
+#include "function_interface.hpp"
+#include "low_latency.hpp"
 #include "rpc_message.hpp"
 
 
@@ -24,21 +36,41 @@
  * Typically, member functions of this class are not called directly, but
  * by FunctionProxy objects instead.
  *
- * This class does not support multithreading, i.e. only one call of the
- * call() member function can be active at any time.
+ * Calls are multiplexed over the connection: every call gets a request id and
+ * replies are matched to their call by that id. A call can be given a timeout,
+ * after which it fails with boost::asio::error::timed_out. Replies that arrive
+ * after their call timed out or was cancelled are ignored.
+ *
+ * The call() and open_stream() member functions block until their reply arrives.
+ * They read and write the socket directly, so the io_service may be shared
+ * with other objects and be run by other threads. Only while asynchronous
+ * calls are outstanding on the same proxy, they wait by running the io_service,
+ * like those asynchronous calls need, unless set_run_by_other_threads() says that
+ * other threads run it. This class does not support multithreading,
+ * i.e. only one call of the call() member function can be active at any time.
  *
  * It is safe to create more than one instance of this class and call
  * the call() member function of those instances concurrently.
+ *
+ * The async_call() member function does not block and can be used to have
+ * more than one call active on the same connection, provided that the caller
+ * runs the io_service.
  */
 class RpcProxy
 {
 public:
+	typedef std::chrono::steady_clock Clock;
+
+	/// Handler that receives the reply frames of an asynchronous call. It is called
+	/// for every frame, or once with an error code if the call failed or timed out.
+	typedef std::function<void (const boost::system::error_code &, RpcReply &)> ReplyHandler;
+
 	/// Constructor starts the asynchronous connect operation.
 	RpcProxy(
 			boost::asio::io_service& io_service,
 			const std::string& host,
 			const std::string& service)
-	: connection_(io_service)
+	: io_service_(io_service), connection_(io_service), lifetime_( std::make_shared<Lifetime>( this))
 	{
 		// Resolve the host name into an IP address.
 		boost::asio::ip::tcp::resolver resolver(io_service);
@@ -49,40 +81,715 @@ public:
 		boost::asio::connect(connection_.socket(), endpoint_iterator);
 	}
 
-	RpcReply call( const RpcMessage &message)
+	/// Constructor that connects to the first of a list of endpoints that accepts the connection.
+	RpcProxy(
+			boost::asio::io_service& io_service,
+			const std::vector<boost::asio::ip::tcp::endpoint> &endpoints)
+	: io_service_(io_service), connection_(io_service), lifetime_( std::make_shared<Lifetime>( this))
+	{
+		boost::asio::connect(connection_.socket(), endpoints.begin(), endpoints.end());
+	}
+
+	/// Constructor that does not connect yet, see async_connect().
+	explicit RpcProxy( boost::asio::io_service& io_service)
+	: io_service_(io_service), connection_(io_service), lifetime_( std::make_shared<Lifetime>( this))
+	{
+	}
+
+	/// Tells the stream generators that outlive this proxy that it is gone.
+	~RpcProxy()
+	{
+		std::lock_guard<std::mutex> lock{ lifetime_->mutex};
+		lifetime_->proxy = nullptr;
+	}
+
+	/**
+	 * Connect to the first of a list of endpoints that accepts the connection, without
+	 * blocking. The handler is called from within the io_service with the outcome.
+	 */
+	template< typename Handler>
+	void async_connect( const std::vector<boost::asio::ip::tcp::endpoint> &endpoints, Handler handler)
+	{
+		auto list = std::make_shared<std::vector<boost::asio::ip::tcp::endpoint>>( endpoints);
+		boost::asio::async_connect( connection_.socket(), list->begin(), list->end(),
+			[list, handler]( const boost::system::error_code &e, std::vector<boost::asio::ip::tcp::endpoint>::iterator) mutable
+			{
+				handler( e);
+			});
+	}
+
+	/// Resolve a host and service name into a list of endpoints.
+	static std::vector<boost::asio::ip::tcp::endpoint> resolve(
+			boost::asio::io_service& io_service,
+			const std::string& host,
+			const std::string& service)
+	{
+		boost::asio::ip::tcp::resolver resolver(io_service);
+		boost::asio::ip::tcp::resolver::query query(host, service);
+		std::vector<boost::asio::ip::tcp::endpoint> endpoints;
+		for (auto endpoint = resolver.resolve(query); endpoint != boost::asio::ip::tcp::resolver::iterator{}; ++endpoint)
+		{
+			endpoints.push_back( *endpoint);
+		}
+		return endpoints;
+	}
+
+	/**
+	 * Call a regular function and wait for its result.
+	 *
+	 * If a timeout is given, the server will drop the call if it can not start it
+	 * in time and this function will throw a boost::system::system_error with
+	 * the timed_out error code when the timeout expires.
+	 */
+	Blob call( const std::string &name, const Blob &parameters, Clock::duration timeout = Clock::duration::zero())
+	{
+		bool done = false;
+		bool handedOver = false;
+		boost::system::error_code error;
+		RpcReply result;
+		const auto deadline = deadline_of( timeout);
+		const RequestId id = start_call( name, parameters, timeout, handedOver,
+			[&]( const boost::system::error_code &e, RpcReply &reply)
+			{
+				std::lock_guard<std::mutex> lock{ repliedMutex_};
+				error = e;
+				result = std::move( reply);
+				done = true;
+				replied_.notify_all();
+			});
+
+		// make sure that the handler, which refers to this stack frame, is forgotten
+		// if the call did not complete normally. A completed call has been forgotten already.
+		try
+		{
+			wait_until( [&]{ return done;}, id, deadline, handedOver);
+		}
+		catch (...)
+		{
+			cancel( id);
+			throw;
+		}
+
+		if (error) throw boost::system::system_error( error);
+
+		check_error( result);
+		return std::move( std::get<2>( result));
+	}
+
+	/**
+	 * Call a streaming function.
+	 *
+	 * The returned generator reads the values from the connection as they arrive.
+	 * A timeout applies to the stream as a whole. If the generator is abandoned before
+	 * the end of the stream, the remaining frames are ignored.
+	 *
+	 * The generator may be destroyed after the proxy, but it must not be advanced after
+	 * that: it then throws a boost::system::system_error with operation_aborted.
+	 */
+	BlobGenerator open_stream( const std::string &name, const Blob &parameters, Clock::duration timeout = Clock::duration::zero())
+	{
+		auto state = std::make_shared<StreamState>( *this);
+		std::weak_ptr<StreamState> weakState = state;
+		state->deadline = deadline_of( timeout);
+		state->id = start_call( name, parameters, timeout, state->handedOver,
+			[weakState]( const boost::system::error_code &e, RpcReply &reply)
+			{
+				auto state = weakState.lock();
+				if (!state) return;
+
+				std::lock_guard<std::mutex> lock{ state->proxy.repliedMutex_};
+				if (e)
+				{
+					state->error = e;
+					state->finished = true;
+				}
+				else if (std::get<1>( reply) == ReplyType::StreamEnd)
+				{
+					state->finished = true;
+				}
+				else
+				{
+					state->finished = std::get<1>( reply) != ReplyType::StreamItem;
+					state->frames.push_back( std::move( reply));
+				}
+				state->proxy.replied_.notify_all();
+			});
+
+		return BlobGenerator{
+			[state]( Blob &value)
+			{
+				if (state->lifetime.expired()) throw boost::system::system_error( boost::asio::error::operation_aborted);
+				state->proxy.wait_until( [&]{ return state->finished || !state->frames.empty();},
+						state->id, state->deadline, state->handedOver);
+
+				std::unique_lock<std::mutex> lock{ state->proxy.repliedMutex_};
+				if (state->frames.empty())
+				{
+					if (state->error) throw boost::system::system_error( state->error);
+					return false;
+				}
+
+				RpcReply reply = std::move( state->frames.front());
+				state->frames.pop_front();
+				lock.unlock();
+				check_error( reply);
+				value = std::move( std::get<2>( reply));
+				return true;
+			}
+		};
+	}
+
+	/**
+	 * Start a call without waiting for the reply.
+	 *
+	 * The handler is called from within the io_service for every reply frame of the call:
+	 * once for a regular function and once for every value and for the end of a stream.
+	 * Returns the request id of the call, which can be used to cancel it.
+	 */
+	RequestId async_call( const std::string &name, const Blob &parameters, Clock::duration timeout, ReplyHandler handler)
+	{
+		const RequestId id = ++lastId_;
+		send_call( id, name, parameters, timeout, std::move( handler));
+		return id;
+	}
+
+	/**
+	 * Start a call with parameters that may be shared with other calls, without waiting
+	 * for the reply. The parameters are not copied, but written straight from the shared
+	 * blob, so sending the same parameters over many proxies serializes them only once.
+	 *
+	 * @see async_call
+	 */
+	RequestId async_call( const std::string &name, const std::shared_ptr<const Blob> &parameters, Clock::duration timeout, ReplyHandler handler)
+	{
+		const RequestId id = ++lastId_;
+		add_call( id, timeout, std::move( handler));
+		const TimeoutMicroseconds budget = budget_of( timeout);
+		connection_.async_write( std::tie( id, budget, name, *parameters), parameters,
+			[this, id]( const boost::system::error_code &e, std::size_t = 0)
+			{
+				if (e) fail( id, e);
+			});
+
+		start_read();
+		return id;
+	}
+
+	/// Forget about a call. Any replies that still arrive for it are ignored.
+	/// Returns false if the call had already completed.
+	bool cancel( RequestId id)
+	{
+		auto call = pending_.find( id);
+		if (call == pending_.end()) return false;
+
+		if (call->second.timer) call->second.timer->cancel();
+		pending_.erase( call);
+		return true;
+	}
+
+	/**
+	 * Close the connection. Outstanding calls fail with an error.
+	 *
+	 * The handlers of the outstanding operations still refer to this object, so it must
+	 * not be destroyed before the io_service has run them.
+	 */
+	void close()
+	{
+		connection_.close();
+	}
+
+	/// Throw an exception if a reply frame reports an error.
+	static void check_error( const RpcReply &reply)
+	{
+		if (std::get<1>( reply) == ReplyType::Overloaded)
+		{
+			throw boost::system::system_error( boost::asio::error::try_again, "server overloaded");
+		}
+		if (std::get<1>( reply) == ReplyType::Error)
+		{
+			const Blob &message = std::get<2>( reply);
+			throw std::runtime_error( std::string( message.begin(), message.end()));
+		}
+	}
+
+	/// Apply socket options, like SocketOptions::LowLatency(), to the connection.
+	void set_socket_options( const SocketOptions &options)
+	{
+		connection_.set_options( options);
+	}
+
+	/**
+	 * Send and receive with the given transport, see Transport. This must be called after
+	 * connecting and before the first call. Returns false if the transport is not available,
+	 * in which case the proxy keeps using the reactor of the io_service.
+	 *
+	 * With io_uring, call() and open_stream() wait for their replies by running the
+	 * io_service, because the ring receives on behalf of the connection.
+	 */
+	bool set_transport( Transport transport, const IoUringOptions &options = IoUringOptions{})
+	{
+		return connection_.set_transport( transport, options);
+	}
+
+	/**
+	 * Tell the proxy whether other threads run its io_service.
+	 *
+	 * If so, call() and the generators of open_stream() never run the io_service themselves.
+	 * When they can not read the socket directly, because asynchronous operations of this
+	 * proxy are in progress, they wait until one of those threads has handed them their reply.
+	 * Otherwise they run the io_service, and restart it if it ran out of work, which is only
+	 * allowed while no other thread runs it.
+	 *
+	 * The handlers of the proxy are not run through a strand, so only one of those threads
+	 * may run the io_service at a time.
+	 */
+	void set_run_by_other_threads( bool enable)
 	{
-		connection_.write( message);
-		return connection_.read<RpcReply>();
+		runByOtherThreads_ = enable;
+	}
+
+	/**
+	 * Make call() and the generators of open_stream() wait for replies by polling the
+	 * socket, or the io_service, in a loop, instead of letting the thread sleep until
+	 * a reply arrives.
+	 *
+	 * This reduces the latency of calls at the cost of processor time.
+	 */
+	void set_busy_polling( bool enable, const BusyPollOptions &options = BusyPollOptions{})
+	{
+		busyPolling_ = enable;
+		busyPollOptions_ = options;
+	}
+
+	/// The number of calls that have not yet received their last reply frame.
+	std::size_t outstanding() const
+	{
+		return pending_.size();
+	}
+
+	/**
+	 * Keep a read in progress, even when there are no outstanding calls, and call the
+	 * handler once when the connection fails, for instance because the server closed it.
+	 *
+	 * This notices a closed connection while it is idle, instead of at the first call
+	 * that uses it. The handler is called from within the io_service, after the outstanding
+	 * calls have failed. While watched, call() and open_stream() run the io_service.
+	 */
+	void watch( std::function<void (const boost::system::error_code &)> handler)
+	{
+		watcher_ = std::move( handler);
+		start_read();
 	}
 
 private:
+	/// A call that has been sent, but that has not received its last reply frame yet.
+	struct PendingCall
+	{
+		ReplyHandler                                handler;
+		std::shared_ptr<boost::asio::steady_timer>  timer;
+	};
+
+	/// Tells objects that may outlive the proxy, like the state of a stream, whether the
+	/// proxy still exists. The proxy is set to null when it is destroyed.
+	struct Lifetime
+	{
+		explicit Lifetime( RpcProxy *p) : proxy( p) {}
+
+		std::mutex	mutex;
+		RpcProxy	*proxy;
+	};
+
+	/// Values of a stream that have been received, but not yet consumed.
+	struct StreamState
+	{
+		explicit StreamState( RpcProxy &p) : proxy( p), lifetime( p.lifetime_) {}
+
+		/// If the stream was abandoned, forget the call. A call that was handed over to the
+		/// threads that run the io_service is forgotten by one of them, if the proxy still
+		/// exists by then. A proxy that no longer exists has forgotten its calls already.
+		~StreamState()
+		{
+			auto proxyLifetime = lifetime.lock();
+			if (!proxyLifetime) return;
+			std::lock_guard<std::mutex> proxyLock{ proxyLifetime->mutex};
+			if (!proxyLifetime->proxy) return;
+
+			std::unique_lock<std::mutex> lock{ proxy.repliedMutex_};
+			if (finished) return;
+			lock.unlock();
+
+			if (!handedOver && !(proxy.runByOtherThreads_ && !proxy.can_block()))
+			{
+				proxy.cancel( id);
+				return;
+			}
+
+			std::weak_ptr<Lifetime> weakLifetime = lifetime;
+			const auto id = this->id;
+			proxy.io_service_.post( [weakLifetime, id]()
+				{
+					auto lifetime = weakLifetime.lock();
+					if (!lifetime) return;
+					std::lock_guard<std::mutex> lock{ lifetime->mutex};
+					if (lifetime->proxy) lifetime->proxy->cancel( id);
+				});
+		}
+
+		RpcProxy                  &proxy;
+		std::weak_ptr<Lifetime>   lifetime;
+		RequestId                 id = 0;
+		Clock::time_point         deadline;
+		bool                      handedOver = false;	///< whether the threads that run the io_service own the call
+		bool                      finished = false;
+		boost::system::error_code error;
+		std::deque<RpcReply>      frames;
+	};
+
+	/// The time at which a call with the given timeout expires.
+	static Clock::time_point deadline_of( Clock::duration timeout)
+	{
+		return timeout > Clock::duration::zero() ? Clock::now() + timeout : Clock::time_point::max();
+	}
+
+	/// The timeout of a call in whole microseconds, rounded up, as the server receives it.
+	static TimeoutMicroseconds budget_of( Clock::duration timeout)
+	{
+		using std::chrono::microseconds;
+		if (timeout <= Clock::duration::zero()) return 0;
+		return std::chrono::duration_cast<microseconds>( timeout + microseconds{1} - Clock::duration{1}).count();
+	}
+
+	/// Register an asynchronous call, which times out after the given timeout, if any.
+	void add_call( RequestId id, Clock::duration timeout, ReplyHandler handler)
+	{
+		PendingCall &call = pending_[id];
+		call.handler = std::move( handler);
+		if (timeout > Clock::duration::zero())
+		{
+			call.timer = std::make_shared<boost::asio::steady_timer>( io_service_, timeout);
+			call.timer->async_wait(
+				[this, id]( const boost::system::error_code &e)
+				{
+					if (!e) fail( id, boost::asio::error::timed_out);
+				});
+		}
+	}
+
+	/// Register and send an asynchronous call with the given id.
+	void send_call( RequestId id, const std::string &name, const Blob &parameters, Clock::duration timeout, ReplyHandler handler)
+	{
+		add_call( id, timeout, std::move( handler));
+		const TimeoutMicroseconds budget = budget_of( timeout);
+		connection_.async_write( std::tie( id, budget, name, parameters),
+			[this, id]( const boost::system::error_code &e, std::size_t = 0)
+			{
+				if (e) fail( id, e);
+			});
+
+		start_read();
+	}
+
+	/// Whether the socket can be used with blocking operations, which is the case when
+	/// no asynchronous read or write is in progress and the socket is not used by a ring.
+	bool can_block() const
+	{
+		return !reading_ && connection_.outbound_bytes() == 0 && connection_.transport() == Transport::Asio;
+	}
+
+	/**
+	 * Start a call for call() or open_stream(). The request is written with a blocking
+	 * write if possible, otherwise this is a regular asynchronous call. If other threads
+	 * run the io_service, one of them sends that call, and handedOver is set.
+	 */
+	RequestId start_call( const std::string &name, const Blob &parameters, Clock::duration timeout, bool &handedOver, ReplyHandler handler)
+	{
+		if (!can_block() && runByOtherThreads_)
+		{
+			// the threads that run the io_service own the outstanding calls, so let one of them send this one.
+			handedOver = true;
+			const RequestId id = ++lastId_;
+			io_service_.post( [this, id, name, parameters, timeout, handler]()
+				{
+					send_call( id, name, parameters, timeout, handler);
+				});
+			return id;
+		}
+		if (!can_block()) return async_call( name, parameters, timeout, std::move( handler));
+
+		const RequestId id = ++lastId_;
+		pending_[id].handler = std::move( handler);
+		const TimeoutMicroseconds budget = budget_of( timeout);
+		try
+		{
+			connection_.write( std::tie( id, budget, name, parameters));
+		}
+		catch (...)
+		{
+			cancel( id);
+			throw;
+		}
+		return id;
+	}
+
+	/**
+	 * Wait until a condition becomes true, while replies are handed to their calls.
+	 *
+	 * If the deadline passes first, the call with the given id fails with timed_out.
+	 * A call that was handed over to the threads of the io_service is waited for until
+	 * those threads have completed it. A call that is left to those threads while waiting
+	 * is handed over from then on.
+	 */
+	template< typename Condition>
+	void wait_until( Condition done, RequestId id, Clock::time_point deadline, bool &handedOver)
+	{
+		if (handedOver)
+		{
+			wait_for_replies( done, id, deadline);
+			return;
+		}
+
+		for (;;)
+		{
+			// while asynchronous operations are in progress, other threads may be handling
+			// replies, so the condition is only checked once it is known that they are not.
+			if (!can_block())
+			{
+				if (runByOtherThreads_)
+				{
+					handedOver = true;
+					wait_for_replies( done, id, deadline);
+				}
+				else
+				{
+					run_until( done, id, deadline);
+				}
+				return;
+			}
+			if (done()) return;
+
+			RpcReply reply;
+			const auto error = connection_.read_before( reply, deadline, busyPolling_ ? &busyPollOptions_ : nullptr);
+			if (error == boost::asio::error::timed_out)
+			{
+				fail( id, error);
+			}
+			else if (error)
+			{
+				fail_all( error);
+			}
+			else
+			{
+				dispatch( reply);
+			}
+		}
+	}
+
+	/// Run the io_service until a condition becomes true, or until the deadline fails the
+	/// call with the given id. An io_service that ran out of work is restarted, which is
+	/// why this must not be used while other threads run it.
+	template< typename Condition>
+	void run_until( Condition done, RequestId id, Clock::time_point deadline)
+	{
+		if (io_service_.stopped()) io_service_.reset();
+		BusyPollBackoff backoff{ busyPollOptions_};
+		while (!done())
+		{
+			if (Clock::now() >= deadline)
+			{
+				fail( id, boost::asio::error::timed_out);
+				continue;
+			}
+
+			if (busyPolling_)
+			{
+				if (io_service_.poll_one())
+				{
+					backoff.reset();
+					continue;
+				}
+				backoff.idle();
+			}
+			else if (deadline == Clock::time_point::max() ? io_service_.run_one() : io_service_.run_one_until( deadline))
+			{
+				continue;
+			}
+
+			if (io_service_.stopped())
+			{
+				throw boost::system::system_error( boost::asio::error::operation_aborted);
+			}
+		}
+	}
+
+	/**
+	 * Wait until a condition becomes true, while other threads run the io_service and hand
+	 * replies to their calls. The condition is checked with the reply mutex locked.
+	 *
+	 * If the deadline passes first, the call with the given id is failed with timed_out by
+	 * one of those threads.
+	 */
+	template< typename Condition>
+	void wait_for_replies( Condition done, RequestId id, Clock::time_point deadline)
+	{
+		std::unique_lock<std::mutex> lock{ repliedMutex_};
+		while (!done())
+		{
+			if (deadline == Clock::time_point::max())
+			{
+				replied_.wait( lock);
+			}
+			else if (replied_.wait_until( lock, deadline) == std::cv_status::timeout && !done())
+			{
+				io_service_.post( [this, id](){ fail( id, boost::asio::error::timed_out);});
+				deadline = Clock::time_point::max();
+			}
+		}
+	}
+
+	/// Make sure that there is a read in progress as long as there are outstanding calls,
+	/// or as long as the connection is watched.
+	void start_read()
+	{
+		if (reading_ || (pending_.empty() && !watcher_)) return;
+
+		reading_ = true;
+		read_next();
+	}
+
+	/// Read the next reply. Reading continues, and reading_ stays set, for as long as there
+	/// are outstanding calls, so that a caller that waits for replies that other threads
+	/// handle never sees a moment without a read in progress.
+	void read_next()
+	{
+		connection_.async_read<RpcReply>(
+			[this]( const boost::system::error_code &e, RpcReply &&reply = RpcReply{})
+			{
+				if (e)
+				{
+					reading_ = false;
+					fail_all( e);
+					if (watcher_)
+					{
+						auto watcher = std::move( watcher_);
+						watcher_ = nullptr;
+						watcher( e);
+					}
+					return;
+				}
+
+				dispatch( reply);
+				if (pending_.empty() && !watcher_) reading_ = false;
+				else read_next();
+			});
+	}
+
+	/// Hand a reply frame to the call that it belongs to.
+	void dispatch( RpcReply &reply)
+	{
+		auto call = pending_.find( std::get<0>( reply));
+		if (call == pending_.end()) return; // late reply of a call that timed out or was cancelled.
+
+		if (std::get<1>( reply) == ReplyType::StreamItem)
+		{
+			call->second.handler( boost::system::error_code{}, reply);
+		}
+		else
+		{
+			// this is the last frame of the call.
+			auto handler = std::move( call->second.handler);
+			cancel( call->first);
+			handler( boost::system::error_code{}, reply);
+		}
+	}
+
+	/// Complete a call with an error.
+	void fail( RequestId id, const boost::system::error_code &e)
+	{
+		auto call = pending_.find( id);
+		if (call == pending_.end()) return;
+
+		auto handler = std::move( call->second.handler);
+		cancel( id);
+		RpcReply none;
+		handler( e, none);
+	}
+
+	void fail_all( const boost::system::error_code &e)
+	{
+		while (!pending_.empty())
+		{
+			fail( pending_.begin()->first, e);
+		}
+	}
+
+	boost::asio::io_service &io_service_;
+
 	/// The connection to the server.
 	connection connection_;
+
+	/// Shared with the stream generators, which may outlive the proxy.
+	const std::shared_ptr<Lifetime> lifetime_;
+
+	/// Id of the most recently sent request.
+	std::atomic<RequestId> lastId_{ 0};
+
+	/// Calls that are waiting for (more) replies, by request id.
+	std::map<RequestId, PendingCall> pending_;
+
+	/// Whether a read of a reply is in progress.
+	std::atomic<bool> reading_{ false};
+
+	/// Called when the connection fails, see watch().
+	std::function<void (const boost::system::error_code &)> watcher_;
+
+	/// Whether other threads run the io_service, see set_run_by_other_threads().
+	bool runByOtherThreads_ = false;
+
+	/// Protects the results that call() and open_stream() wait for, which are set by reply
+	/// handlers, and signals their arrival.
+	std::mutex repliedMutex_;
+	std::condition_variable replied_;
+
+	/// Whether to wait for replies by polling and how to back off.
+	bool busyPolling_ = false;
+	BusyPollOptions busyPollOptions_;
 };
 
 /**
- * This class stores a function name and implements the FunctionInterface interface
+ * This class stores a function name and implements the FunctionInterface and
+ * StreamFunctionInterface interfaces.
  *
- * Whenever the Call member function is called, it will create an RpcMessage
- * that includes the function name and then delegate the call to an RpcProxy.
+ * Whenever the Call or CallStream member function is called, it will create an RpcMessage
+ * that includes the function name and then delegate the call to a proxy object. The
+ * proxy is an RpcProxy or any other class with the same call() and open_stream() member
+ * functions, like RpcProxyPool.
  */
-class FunctionProxy : public FunctionInterface
+template< typename Proxy = RpcProxy>
+class FunctionProxy : public FunctionInterface, public StreamFunctionInterface
 {
 public:
-	FunctionProxy( const std::string &name, RpcProxy &rpc)
-	: m_functionName{ name}, m_rpcProxy( rpc)
+	typedef RpcProxy::Clock::duration Duration;
+
+	FunctionProxy( const std::string &name, Proxy &rpc, Duration timeout = Duration::zero())
+	: m_functionName{ name}, m_rpcProxy( rpc), m_timeout{ timeout}
 	{
 	}
 
     Blob Call(const Blob &parameters) override
 	{
-    	return m_rpcProxy.call( std::tie(m_functionName, parameters));
+    	return m_rpcProxy.call( m_functionName, parameters, m_timeout);
+	}
+
+    BlobGenerator CallStream(const Blob &parameters) override
+	{
+    	return m_rpcProxy.open_stream( m_functionName, parameters, m_timeout);
 	}
 
     virtual ~FunctionProxy(){};
-private:
+protected:
 	const std::string 	m_functionName;
-	RpcProxy 			&m_rpcProxy;
+	Proxy 				&m_rpcProxy;
+	const Duration		m_timeout;
 };
 
 /**
@@ -90,19 +797,23 @@ private:
  *
  * The function proxy acts as a regular function (functor), but
  * will forward all function calls to a remote server through the
- * RpcProxy object.
+ * RpcProxy object (or other proxy object, like an RpcProxyPool).
+ *
+ * If a timeout is given, every call of the function proxy carries a deadline
+ * and throws if no reply was received in time.
  *
  * @see BinaryFunctionMarshaller
  *
  */
-template<typename ReturnType, typename... Parameters>
+template<typename ReturnType, typename... Parameters, typename Proxy>
 BinaryFunctionMarshaller< ReturnType (Parameters...)> CreateProxyFunction(
         ReturnType (*)( Parameters...),
-		RpcProxy &rpcProxy,
-		const std::string &functionName
+		Proxy &rpcProxy,
+		const std::string &functionName,
+		RpcProxy::Clock::duration timeout = RpcProxy::Clock::duration::zero()
     )
 {
-	auto proxy = std::make_shared<FunctionProxy>( functionName, rpcProxy);
+	auto proxy = std::make_shared<FunctionProxy<Proxy>>( functionName, rpcProxy, timeout);
     return BinaryFunctionMarshaller< ReturnType (Parameters...)>{proxy};
 }
 
@@ -112,18 +823,22 @@ BinaryFunctionMarshaller< ReturnType (Parameters...)> CreateProxyFunction(
  *
  * The function proxy acts as a regular function (functor), but
  * will forward all function calls to a remote server through the
- * RpcProxy object.
+ * RpcProxy object (or other proxy object, like an RpcProxyPool).
+ *
+ * If a timeout is given, every call of the function proxy carries a deadline
+ * and throws if no reply was received in time.
  *
  * @see BinaryFunctionMarshaller
  *
  */
-template< typename FunctionType>
+template< typename FunctionType, typename Proxy>
 BinaryFunctionMarshaller< FunctionType> CreateProxyFunction(
-    RpcProxy &rpcProxy,
-    const std::string &functionName
+    Proxy &rpcProxy,
+    const std::string &functionName,
+    RpcProxy::Clock::duration timeout = RpcProxy::Clock::duration::zero()
     )
 {
-    auto proxy = std::make_shared<FunctionProxy>( functionName, rpcProxy);
+    auto proxy = std::make_shared<FunctionProxy<Proxy>>( functionName, rpcProxy, timeout);
     return BinaryFunctionMarshaller< FunctionType>{proxy};
 }
 
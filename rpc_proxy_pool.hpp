@@ -0,0 +1,598 @@
+//
+//  Copyright (C) 2017 Danny Havenith
+//
+//  Distributed under the Boost Software License, Version 1.0. (See
+//  accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt)
+//
+#ifndef RPC_PROXY_POOL_HPP_
+#define RPC_PROXY_POOL_HPP_
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rpc_proxy.hpp"
+
+/// Host and service (port) of an RpcService.
+struct RpcAddress
+{
+    std::string host;
+    std::string service;
+};
+
+/**
+ * Options that determine the size of an RpcProxyPool.
+ */
+struct RpcProxyPoolOptions
+{
+    /// The number of connections that the pool keeps open, even when they are idle.
+    std::size_t minConnections = 1;
+
+    /// The maximum number of connections that the pool opens.
+    std::size_t maxConnections = 4;
+
+    /// The pool opens another connection when every connection has at least
+    /// this many calls outstanding.
+    std::size_t callsPerConnection = 8;
+
+    /// Connections above the minimum are closed when they have not been used for this long.
+    RpcProxy::Clock::duration idleTimeout = std::chrono::seconds( 30);
+};
+
+/**
+ * A thread-safe proxy that spreads calls over a pool of connections to a
+ * single RPC service.
+ *
+ * An RpcProxyPool can be used wherever an RpcProxy can be used, in particular
+ * with CreateProxyFunction. Unlike an RpcProxy, it can be called from any
+ * number of threads at the same time.
+ *
+ * The pool owns an io_service and a thread that runs it. Every call is handed
+ * to the connection that has the fewest outstanding calls, where it is
+ * multiplexed with the other calls on that connection. The calling thread
+ * blocks until the reply arrives.
+ *
+ * The pool opens new connections when all connections are busy, up to a
+ * maximum, and closes connections that have been idle for a while. A
+ * connection that fails is taken out of the pool, and is replaced by a new
+ * connection when one is needed. Connections are made by the thread of the
+ * pool, so a service that does not accept connections never blocks the
+ * callers; calls only wait for a new connection when there is no other.
+ */
+class RpcProxyPool
+{
+public:
+    typedef RpcProxy::Clock Clock;
+    typedef std::vector<boost::asio::ip::tcp::endpoint> Endpoints;
+
+    RpcProxyPool(
+        const std::string &host,
+        const std::string &service,
+        const RpcProxyPoolOptions &options = RpcProxyPoolOptions{})
+    : m_options( options),
+      m_lifetime( new Lifetime{ this}),
+      m_work( new boost::asio::io_service::work( m_ioService)),
+      m_maintenanceTimer( m_ioService)
+    {
+        m_endpoints = RpcProxy::resolve( m_ioService, host, service);
+        for (std::size_t count = 0; count < m_options.minConnections; ++count)
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex};
+            connect();
+        }
+
+        schedule_maintenance();
+        m_thread = std::thread( [this](){ m_ioService.run();});
+    }
+
+    RpcProxyPool( const RpcProxyPool &) = delete;
+    RpcProxyPool &operator=( const RpcProxyPool &) = delete;
+
+    ~RpcProxyPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock{ m_lifetime->mutex};
+            m_lifetime->pool = nullptr;
+        }
+
+        m_ioService.post( [this]()
+            {
+                m_maintenanceTimer.cancel();
+                std::lock_guard<std::mutex> lock{ m_mutex};
+                for (auto &slot : m_slots)
+                {
+                    slot->proxy.close();
+                }
+            });
+        m_work.reset();
+        m_thread.join();
+    }
+
+    /**
+     * Call a regular function and wait for its result.
+     *
+     * @see RpcProxy::call
+     */
+    Blob call( const std::string &name, const Blob &parameters, Clock::duration timeout = Clock::duration::zero())
+    {
+        auto result = std::make_shared<std::promise<RpcReply>>();
+        auto future = result->get_future();
+
+        async_call( name, parameters, timeout,
+            [result]( const boost::system::error_code &e, RpcReply &reply)
+            {
+                if (e)
+                {
+                    result->set_exception( std::make_exception_ptr( boost::system::system_error( e)));
+                }
+                else
+                {
+                    result->set_value( std::move( reply));
+                }
+            });
+
+        RpcReply reply = future.get();
+        RpcProxy::check_error( reply);
+        return std::move( std::get<2>( reply));
+    }
+
+    /// Identifies a call that was started with async_call().
+    struct AsyncCall;
+    typedef std::shared_ptr<AsyncCall> AsyncCallPtr;
+
+    /**
+     * Start a call of a regular function without waiting for the reply.
+     *
+     * The handler is called exactly once, from the thread of the pool, with either the
+     * reply or an error. It should not block. The returned object can be used to cancel
+     * the call. This function does not block, not even if the pool needs to connect first.
+     */
+    AsyncCallPtr async_call( const std::string &name, const Blob &parameters, Clock::duration timeout, RpcProxy::ReplyHandler handler)
+    {
+        return async_call( name, std::make_shared<const Blob>( parameters), timeout, std::move( handler));
+    }
+
+    /**
+     * Start a call with parameters that may be shared with other calls, without waiting
+     * for the reply. The parameters are neither copied nor serialized again.
+     *
+     * @see async_call
+     */
+    AsyncCallPtr async_call( const std::string &name, std::shared_ptr<const Blob> parameters, Clock::duration timeout, RpcProxy::ReplyHandler handler)
+    {
+        auto call = std::make_shared<AsyncCall>( acquire());
+
+        m_ioService.post( [this, call, name, parameters, timeout, handler]()
+            {
+                when_connected( call->slot, [this, call, name, parameters, timeout, handler]( const boost::system::error_code &e)
+                    {
+                        if (call->cancelled)
+                        {
+                            release( call->slot, boost::system::error_code{});
+                            return;
+                        }
+                        if (e)
+                        {
+                            RpcReply none;
+                            release( call->slot, e);
+                            handler( e, none);
+                            return;
+                        }
+
+                        call->id = call->slot->proxy.async_call( name, parameters, timeout,
+                            [this, call, handler]( const boost::system::error_code &e, RpcReply &reply)
+                            {
+                                release( call->slot, e);
+                                handler( e, reply);
+                            });
+                    });
+            });
+
+        return call;
+    }
+
+    /**
+     * Forget about a call that was started with async_call(). If the call had not completed
+     * yet, its handler will not be called.
+     *
+     * The server is not told about the cancellation, it only stops the pool from waiting
+     * for the reply.
+     */
+    void cancel( const AsyncCallPtr &call)
+    {
+        m_ioService.post( [this, call]()
+            {
+                call->cancelled = true;
+                if (call->id && call->slot->proxy.cancel( call->id))
+                {
+                    release( call->slot, boost::system::error_code{});
+                }
+            });
+    }
+
+    /**
+     * Call a streaming function.
+     *
+     * The connection that carries the stream counts the stream as one outstanding
+     * call until it has ended or until the generator is destroyed. The generator may
+     * outlive the pool, in which case it ends with an error once the pool is gone.
+     *
+     * @see RpcProxy::open_stream
+     */
+    BlobGenerator open_stream( const std::string &name, const Blob &parameters, Clock::duration timeout = Clock::duration::zero())
+    {
+        auto slot = acquire();
+        auto state = std::make_shared<StreamState>( m_lifetime, slot);
+        std::weak_ptr<StreamState> weakState = state;
+
+        m_ioService.post( [this, slot, weakState, name, parameters, timeout]()
+            {
+                when_connected( slot, [this, slot, weakState, name, parameters, timeout]( const boost::system::error_code &e)
+                    {
+                        if (e) fail_stream( slot, weakState, e);
+                        else start_stream( slot, weakState, name, parameters, timeout);
+                    });
+            });
+
+        return BlobGenerator{
+            [state]( Blob &value)
+            {
+                std::unique_lock<std::mutex> lock{ state->mutex};
+                state->arrived.wait( lock, [&]{ return state->finished || !state->frames.empty();});
+                if (state->frames.empty())
+                {
+                    if (state->error) throw boost::system::system_error( state->error);
+                    return false;
+                }
+
+                RpcReply reply = std::move( state->frames.front());
+                state->frames.pop_front();
+                lock.unlock();
+
+                RpcProxy::check_error( reply);
+                value = std::move( std::get<2>( reply));
+                return true;
+            }
+        };
+    }
+
+    /// The number of connections in the pool.
+    std::size_t size() const
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        return m_slots.size();
+    }
+
+private:
+    /// Tells objects that may outlive the pool, like the state of a stream, whether the
+    /// pool still exists. The pool is set to null when its destruction starts.
+    struct Lifetime
+    {
+        explicit Lifetime( RpcProxyPool *p) : pool( p) {}
+
+        std::mutex      mutex;
+        RpcProxyPool    *pool;
+    };
+
+    /// A connection in the pool.
+    struct Slot
+    {
+        explicit Slot( boost::asio::io_service &ioService)
+        : proxy( ioService), lastUsed( Clock::now())
+        {
+        }
+
+        RpcProxy            proxy;
+        std::size_t         load = 0;           ///< calls that have been handed to this connection and not completed
+        bool                connected = false;  ///< whether the connection has been made
+        bool                broken = false;     ///< whether the connection has failed
+        boost::system::error_code error;    ///< why the connection could not be made
+        Clock::time_point   lastUsed;
+
+        /// Calls that wait for the connection to be made, with the outcome.
+        std::vector<std::function<void (const boost::system::error_code &)>> waiting;
+    };
+    typedef std::shared_ptr<Slot> SlotPtr;
+
+public:
+    /// Only the io thread uses the members of an AsyncCall.
+    struct AsyncCall
+    {
+        explicit AsyncCall( SlotPtr s) : slot( s) {}
+
+        SlotPtr     slot;
+        RequestId   id = 0;
+        bool        cancelled = false;
+    };
+
+private:
+
+    /// Values of a stream that have been received, but not yet consumed.
+    struct StreamState
+    {
+        StreamState( std::weak_ptr<Lifetime> l, SlotPtr s) : lifetime( l), slot( s) {}
+
+        /// If the stream was abandoned, forget the call. Only the io thread may touch the proxy.
+        /// A pool that is being destroyed fails the call itself.
+        ~StreamState()
+        {
+            std::lock_guard<std::mutex> lock{ mutex};
+            if (finished) return;
+
+            auto poolLifetime = lifetime.lock();
+            if (!poolLifetime) return;
+            std::lock_guard<std::mutex> poolLock{ poolLifetime->mutex};
+            if (!poolLifetime->pool) return;
+
+            auto &pool = *poolLifetime->pool;
+            auto slot = this->slot;
+            auto id = this->id;
+            pool.m_ioService.post( [&pool, slot, id]()
+                {
+                    if (id && slot->proxy.cancel( id))
+                    {
+                        pool.release( slot, boost::system::error_code{});
+                    }
+                });
+        }
+
+        std::weak_ptr<Lifetime>     lifetime;
+        SlotPtr                     slot;
+        RequestId                   id = 0;
+        std::mutex                  mutex;
+        std::condition_variable     arrived;
+        bool                        finished = false;
+        boost::system::error_code   error;
+        std::deque<RpcReply>        frames;
+    };
+
+    /**
+     * Select the connection for a new call and count the call in its load.
+     *
+     * Another connection is opened if all connections are busy and the pool is not at its
+     * maximum size. This does not block: connections are made by the io thread and the call
+     * only waits for the new connection if there is no other.
+     */
+    SlotPtr acquire()
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        auto best = least_loaded();
+        const bool grow = m_slots.size() < m_options.maxConnections && !m_connecting;
+        if (!best || (best->load >= m_options.callsPerConnection && grow))
+        {
+            auto slot = connect();
+            if (!best) best = slot;
+        }
+
+        ++best->load;
+        return best;
+    }
+
+    /**
+     * Return the healthy connection with the smallest load, or an empty pointer if there is
+     * none. Connections that are still being made are only returned if there is no other.
+     */
+    SlotPtr least_loaded() const
+    {
+        SlotPtr best;
+        for (auto &slot : m_slots)
+        {
+            if (slot->broken) continue;
+            if (!best
+                || (slot->connected && !best->connected)
+                || (slot->connected == best->connected && slot->load < best->load))
+            {
+                best = slot;
+            }
+        }
+        return best;
+    }
+
+    /// Add a connection to the pool and let the io thread make it. This is called with the mutex locked.
+    SlotPtr connect()
+    {
+        auto slot = std::make_shared<Slot>( m_ioService);
+        m_slots.push_back( slot);
+        ++m_connecting;
+
+        m_ioService.post( [this, slot]()
+            {
+                slot->proxy.async_connect( m_endpoints, [this, slot]( const boost::system::error_code &e)
+                    {
+                        std::vector<std::function<void (const boost::system::error_code &)>> waiting;
+                        {
+                            std::lock_guard<std::mutex> lock{ m_mutex};
+                            --m_connecting;
+                            slot->connected = !e;
+                            if (e) broken( slot, e);
+                            waiting.swap( slot->waiting);
+                        }
+
+                        if (!e) watch( slot);
+                        for (auto &start : waiting) start( e);
+                    });
+            });
+
+        return slot;
+    }
+
+    /**
+     * Take a connection out of the pool as soon as it fails, also when it is idle. Otherwise
+     * a connection that the service closed, for instance because it restarted, would only
+     * be found out by the next call that uses it, which would fail.
+     */
+    void watch( const SlotPtr &slot)
+    {
+        std::weak_ptr<Slot> weakSlot = slot;
+        slot->proxy.watch( [this, weakSlot]( const boost::system::error_code &e)
+            {
+                auto slot = weakSlot.lock();
+                if (!slot) return;
+
+                std::lock_guard<std::mutex> lock{ m_mutex};
+                broken( slot, e);
+            });
+    }
+
+    /// Mark a connection as failed and take it out of the pool if it has no calls. This is
+    /// called from the io thread with the mutex locked.
+    void broken( const SlotPtr &slot, const boost::system::error_code &e)
+    {
+        if (!slot->broken)
+        {
+            slot->broken = true;
+            slot->error = e;
+        }
+        if (!slot->load) remove( slot);
+    }
+
+    /**
+     * Call a function once the connection of a slot has been made, or has failed. This is
+     * called from the io thread. A connection that failed in the meantime passes its error.
+     */
+    template< typename Function>
+    void when_connected( const SlotPtr &slot, Function start)
+    {
+        boost::system::error_code e;
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex};
+            if (!slot->connected && !slot->broken)
+            {
+                slot->waiting.emplace_back( std::move( start));
+                return;
+            }
+            if (slot->broken) e = slot->error ? slot->error : boost::asio::error::not_connected;
+        }
+        start( e);
+    }
+
+    /// Send a streaming call, once its connection is made. This is called from the io thread.
+    void start_stream( const SlotPtr &slot, std::weak_ptr<StreamState> weakState,
+        const std::string &name, const Blob &parameters, Clock::duration timeout)
+    {
+        auto id = slot->proxy.async_call( name, parameters, timeout,
+            [this, slot, weakState]( const boost::system::error_code &e, RpcReply &reply)
+            {
+                const bool last = e || std::get<1>( reply) != ReplyType::StreamItem;
+                if (last) release( slot, e);
+
+                auto state = weakState.lock();
+                if (!state) return;
+
+                std::lock_guard<std::mutex> lock{ state->mutex};
+                state->error = e;
+                state->finished = last;
+                if (!e && std::get<1>( reply) != ReplyType::StreamEnd)
+                {
+                    state->frames.push_back( std::move( reply));
+                }
+                state->arrived.notify_one();
+            });
+
+        // the stream state may already be gone if the generator was discarded right away.
+        auto state = weakState.lock();
+        if (state)
+        {
+            std::lock_guard<std::mutex> lock{ state->mutex};
+            state->id = id;
+        }
+        else if (slot->proxy.cancel( id))
+        {
+            release( slot, boost::system::error_code{});
+        }
+    }
+
+    /// Complete a streaming call whose connection could not be made. This is called from the io thread.
+    void fail_stream( const SlotPtr &slot, std::weak_ptr<StreamState> weakState, const boost::system::error_code &e)
+    {
+        release( slot, e);
+        auto state = weakState.lock();
+        if (!state) return;
+
+        std::lock_guard<std::mutex> lock{ state->mutex};
+        state->error = e;
+        state->finished = true;
+        state->arrived.notify_one();
+    }
+
+    /// Administer the completion of a call. This is called from the io thread.
+    void release( const SlotPtr &slot, const boost::system::error_code &e)
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        --slot->load;
+        slot->lastUsed = Clock::now();
+
+        // a timeout says nothing about the health of the connection, other errors do.
+        if (e && e != boost::asio::error::timed_out)
+        {
+            broken( slot, e);
+        }
+        else if (slot->broken && !slot->load)
+        {
+            remove( slot);
+        }
+    }
+
+    /// Take a connection out of the pool. This is called from the io thread with the mutex locked.
+    void remove( SlotPtr slot)
+    {
+        m_slots.erase( std::remove( m_slots.begin(), m_slots.end(), slot), m_slots.end());
+        slot->proxy.close();
+
+        // the proxy can only be destroyed after the handlers that were aborted by closing it have run.
+        m_ioService.post( [slot](){});
+    }
+
+    /// Periodically close connections that have been idle for too long.
+    void schedule_maintenance()
+    {
+        m_maintenanceTimer.expires_from_now( std::min<Clock::duration>( m_options.idleTimeout, std::chrono::seconds( 1)));
+        m_maintenanceTimer.async_wait( [this]( const boost::system::error_code &e)
+            {
+                if (e) return;
+
+                std::lock_guard<std::mutex> lock{ m_mutex};
+                const auto idleSince = Clock::now() - m_options.idleTimeout;
+                std::vector<SlotPtr> idle;
+                for (auto &slot : m_slots)
+                {
+                    if (slot->connected && !slot->load && slot->lastUsed < idleSince)
+                    {
+                        idle.push_back( slot);
+                    }
+                }
+                for (auto &slot : idle)
+                {
+                    if (m_slots.size() <= m_options.minConnections) break;
+                    remove( slot);
+                }
+
+                schedule_maintenance();
+            });
+    }
+
+    const RpcProxyPoolOptions                       m_options;
+    const std::shared_ptr<Lifetime>                 m_lifetime;
+    boost::asio::io_service                         m_ioService;
+    std::unique_ptr<boost::asio::io_service::work>  m_work;
+    boost::asio::steady_timer                       m_maintenanceTimer;
+    Endpoints                                       m_endpoints;
+
+    /// Protects the slots and their bookkeeping, which are used by calling threads and by the io thread.
+    mutable std::mutex                              m_mutex;
+    std::vector<SlotPtr>                            m_slots;
+    std::size_t                                     m_connecting = 0;
+
+    std::thread                                     m_thread;
+};
+
+#endif /* RPC_PROXY_POOL_HPP_ */
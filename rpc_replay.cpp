@@ -0,0 +1,368 @@
+//
+//  Copyright (C) 2017 Danny Havenith
+//
+//  Distributed under the Boost Software License, Version 1.0. (See
+//  accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Replay the traffic in a capture file, as written by RpcService::start_capture(),
+// against a service and report the latency distribution and the throughput.
+//
+// usage: rpc_replay [--no-low-latency] <capture file> <host> <port> [connections] [speed]
+//
+// The connections use SocketOptions::LowLatency(), so that the latencies do not
+// include waits for Nagle's algorithm and delayed acknowledgements, unless
+// --no-low-latency is given.
+//
+// The calls are sent open-loop: every call is sent at the time at which it was
+// received in the capture, divided by the speed factor, whether or not earlier calls
+// have been answered. The latency of a call is measured from that scheduled time, so
+// a service that falls behind is not hidden by calls that are sent late.
+//
+// A capture file can hold several capture sessions. These are replayed one after the
+// other, without the idle time between them.
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "binary_function_marshaller.hpp"
+#include "latency_histogram.hpp"
+#include "rpc_proxy.hpp"
+#include "traffic_capture.hpp"
+
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/vector.hpp>
+
+/// A frame in the capture file. The frame itself stays in the mapped file.
+struct CapturedFrame
+{
+    std::int64_t    offset;     ///< when to send the frame, in microseconds from the start of the replay
+    std::uint32_t   connection; ///< the connection that received the frame, unique within the file
+    const char      *frame;
+    std::size_t     size;
+};
+
+/**
+ * A capture file, mapped into memory.
+ *
+ * The frames of all capture sessions in the file are put on a single timeline, in
+ * which every session starts right after the last frame of the previous one.
+ */
+class CaptureFile
+{
+public:
+    explicit CaptureFile( const std::string &path)
+    : m_mapping( path.c_str(), boost::interprocess::read_only),
+      m_region( m_mapping, boost::interprocess::read_only)
+    {
+        std::vector<CaptureRecordHeader> session;
+        std::vector<const char *> frames;
+
+        const char *position = static_cast<const char *>( m_region.get_address());
+        const char *end = position + m_region.get_size();
+        while (end - position >= static_cast<std::ptrdiff_t>( sizeof (CaptureRecordHeader)))
+        {
+            CaptureRecordHeader header;
+            std::memcpy( &header, position, sizeof header);
+            position += sizeof header;
+            if (static_cast<std::size_t>( end - position) < header.size) break; // the capture was cut off while writing.
+
+            if (!header.size)
+            {
+                add_session( session, frames);
+            }
+            else
+            {
+                session.push_back( header);
+                frames.push_back( position);
+            }
+            position += header.size;
+        }
+        add_session( session, frames);
+    }
+
+    const std::vector<CapturedFrame> &frames() const
+    {
+        return m_frames;
+    }
+
+private:
+    /// Append the frames of a session to the timeline and start a new session.
+    void add_session( std::vector<CaptureRecordHeader> &headers, std::vector<const char *> &frames)
+    {
+        if (headers.empty()) return;
+
+        // the records of a session are in the order of their timestamps.
+        const std::int64_t start = m_frames.empty() ? 0 : m_frames.back().offset;
+        const std::uint64_t first = headers.front().timestamp;
+        std::map<std::uint32_t, std::uint32_t> connections;
+        for (std::size_t index = 0; index < headers.size(); ++index)
+        {
+            const auto &header = headers[index];
+            auto connection = connections.insert( std::make_pair( header.connection, m_connections));
+            if (connection.second) ++m_connections;
+
+            m_frames.push_back( CapturedFrame{
+                start + static_cast<std::int64_t>( header.timestamp - first),
+                connection.first->second,
+                frames[index],
+                header.size});
+        }
+
+        headers.clear();
+        frames.clear();
+    }
+
+    boost::interprocess::file_mapping   m_mapping;
+    boost::interprocess::mapped_region  m_region;
+    std::vector<CapturedFrame>          m_frames;
+    std::uint32_t                       m_connections = 0;
+};
+
+/// De-serialize the RpcMessage in a captured frame, skipping the 8-byte size in front of it.
+bool DecodeMessage( const CapturedFrame &captured, RpcMessage &message)
+{
+    using namespace boost::iostreams;
+    using namespace boost::archive;
+
+    const std::size_t header_length = 8;
+    if (captured.size < header_length) return false;
+    try
+    {
+        stream<basic_array_source<char>> dataStream{ captured.frame + header_length, captured.size - header_length};
+        binary_iarchive archive{ dataStream};
+        archive >> message;
+    }
+    catch (std::exception &)
+    {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Sends the captured calls according to their schedule and keeps the statistics.
+ */
+class Replay
+{
+public:
+    typedef RpcProxy::Clock Clock;
+
+    Replay(
+        boost::asio::io_service &io_service,
+        const std::vector<CapturedFrame> &frames,
+        const std::string &host,
+        const std::string &port,
+        unsigned connections,
+        double speed,
+        const SocketOptions &socketOptions)
+    : m_frames( frames), m_speed( speed), m_timer( io_service)
+    {
+        for (unsigned count = 0; count < connections; ++count)
+        {
+            m_proxies.emplace_back( new RpcProxy{ io_service, host, port});
+            m_proxies.back()->set_socket_options( socketOptions);
+        }
+    }
+
+    void start()
+    {
+        m_start = Clock::now();
+        send_due();
+    }
+
+    void report( std::ostream &out) const
+    {
+        using std::chrono::duration_cast;
+        using std::chrono::duration;
+        using std::chrono::microseconds;
+
+        const double seconds = duration<double>( m_finish - m_start).count();
+        const double capturedSeconds = m_frames.size() > 1
+            ? (m_frames.back().offset - m_frames.front().offset) / 1e6
+            : 0;
+
+        out << "calls:       " << m_sent << " sent, " << m_latencies.count() << " replied, "
+            << m_errors << " errors, " << m_overloaded << " overloaded, " << m_undecodable << " undecodable\n";
+        out << "duration:    " << seconds << " s (captured: " << capturedSeconds << " s)\n";
+        if (capturedSeconds > 0)
+        {
+            out << "offered:     " << m_frames.size() / capturedSeconds * m_speed << " calls/s\n";
+        }
+        if (seconds > 0)
+        {
+            out << "throughput:  " << m_latencies.count() / seconds << " calls/s\n";
+        }
+        out << "send lag:    " << m_maxLag.count() << " us at most\n";
+        out << "latency:     mean " << m_latencies.mean().count()
+            << " us, p50 " << m_latencies.percentile( .5).count()
+            << " us, p90 " << m_latencies.percentile( .9).count()
+            << " us, p99 " << m_latencies.percentile( .99).count()
+            << " us, p99.9 " << m_latencies.percentile( .999).count()
+            << " us, max " << m_latencies.max().count() << " us\n";
+    }
+
+private:
+    /// The time at which a captured frame must be sent.
+    Clock::time_point scheduled( const CapturedFrame &frame) const
+    {
+        const auto offset = std::chrono::microseconds( frame.offset);
+        return m_start + std::chrono::duration_cast<Clock::duration>( offset / m_speed);
+    }
+
+    /// Send all calls whose time has come and wait for the next one.
+    void send_due()
+    {
+        const auto now = Clock::now();
+        for (; m_next < m_frames.size() && scheduled( m_frames[m_next]) <= now; ++m_next)
+        {
+            send( m_frames[m_next], now);
+        }
+
+        if (m_next < m_frames.size())
+        {
+            m_timer.expires_at( scheduled( m_frames[m_next]));
+            m_timer.async_wait( [this]( const boost::system::error_code &e)
+                {
+                    if (!e) send_due();
+                });
+        }
+        else
+        {
+            finish_if_done();
+        }
+    }
+
+    void send( const CapturedFrame &frame, Clock::time_point now)
+    {
+        RpcMessage message;
+        if (!DecodeMessage( frame, message))
+        {
+            ++m_undecodable;
+            return;
+        }
+
+        const auto due = scheduled( frame);
+        m_maxLag = std::max( m_maxLag, std::chrono::duration_cast<std::chrono::microseconds>( now - due));
+
+        // calls of one captured connection keep using the same connection.
+        RpcProxy &proxy = *m_proxies[frame.connection % m_proxies.size()];
+        const auto timeout = std::chrono::microseconds( std::get<1>( message));
+        ++m_sent;
+        ++m_outstanding;
+        proxy.async_call( std::get<2>( message), std::get<3>( message), timeout,
+            [this, due]( const boost::system::error_code &e, RpcReply &reply)
+            {
+                if (!e && std::get<1>( reply) == ReplyType::StreamItem) return;
+
+                --m_outstanding;
+                if (e || std::get<1>( reply) == ReplyType::Error)
+                {
+                    ++m_errors;
+                }
+                else if (std::get<1>( reply) == ReplyType::Overloaded)
+                {
+                    ++m_overloaded;
+                }
+                else
+                {
+                    m_latencies.record( Clock::now() - due);
+                }
+                finish_if_done();
+            });
+    }
+
+    void finish_if_done()
+    {
+        if (m_next < m_frames.size() || m_outstanding) return;
+
+        m_finish = Clock::now();
+        for (auto &proxy : m_proxies)
+        {
+            proxy->close();
+        }
+    }
+
+    const std::vector<CapturedFrame>        &m_frames;
+    const double                            m_speed;
+    boost::asio::steady_timer               m_timer;
+    std::vector<std::unique_ptr<RpcProxy>>  m_proxies;
+
+    Clock::time_point                       m_start;
+    Clock::time_point                       m_finish;
+    std::size_t                             m_next = 0;
+    std::size_t                             m_outstanding = 0;
+
+    std::uint64_t                           m_sent = 0;
+    std::uint64_t                           m_errors = 0;
+    std::uint64_t                           m_overloaded = 0;
+    std::uint64_t                           m_undecodable = 0;
+    std::chrono::microseconds               m_maxLag{ 0};
+    LatencyHistogram                        m_latencies;
+};
+
+int main( int argc, const char *argv[])
+{
+    SocketOptions socketOptions = SocketOptions::LowLatency();
+    std::vector<const char *> arguments;
+    for (int index = 1; index < argc; ++index)
+    {
+        if (std::strcmp( argv[index], "--no-low-latency") == 0)
+        {
+            socketOptions = SocketOptions{};
+        }
+        else
+        {
+            arguments.push_back( argv[index]);
+        }
+    }
+
+    if (arguments.size() < 3)
+    {
+        std::cerr << "usage: " << argv[0] << " [--no-low-latency] <capture file> <host> <port> [connections] [speed]\n";
+        return 1;
+    }
+
+    const unsigned connections = arguments.size() > 3 ? std::max( 1, std::atoi( arguments[3])) : 16;
+    const double speed = arguments.size() > 4 ? std::atof( arguments[4]) : 1.0;
+    if (speed <= 0)
+    {
+        std::cerr << "the speed must be positive\n";
+        return 1;
+    }
+
+    try
+    {
+        CaptureFile capture{ arguments[0]};
+        if (capture.frames().empty())
+        {
+            std::cerr << "no frames in " << arguments[0] << '\n';
+            return 1;
+        }
+
+        boost::asio::io_service io_service;
+        Replay replay{ io_service, capture.frames(), arguments[1], arguments[2], connections, speed, socketOptions};
+        replay.start();
+        io_service.run();
+        replay.report( std::cout);
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "replay failed: " << e.what() << '\n';
+        return 1;
+    }
+
+    return 0;
+}
@@ -11,74 +11,370 @@
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include "connection.hpp"
 #include <boost/serialization/vector.hpp>
 #include "binary_function_wrapper.hpp"
+#include "function_registry.hpp"
+#include "latency_histogram.hpp"
+#include "rpc_message.hpp"
 
 /**
- * An RpcService object has a map of string->FunctionInterface pointers. It
+ * Latency statistics of the calls in a single priority class.
+ */
+struct PriorityClassMetrics
+{
+    LatencyHistogram waiting;   ///< time between reading a message and starting its call
+    LatencyHistogram latency;   ///< time between reading a message and queuing its reply
+};
+
+/**
+ * Counters that describe the work done by an RpcService.
+ */
+struct RpcServiceMetrics
+{
+    std::uint64_t requests = 0; ///< messages received
+    std::uint64_t expired = 0;  ///< calls dropped because their deadline passed before they were run
+    std::uint64_t errors = 0;   ///< calls that were answered with an error reply
+    std::uint64_t shed = 0;     ///< calls that were refused with an overloaded reply
+    std::uint64_t pauses = 0;   ///< number of times that reading from a connection was paused
+    std::size_t   inFlight = 0; ///< calls that were accepted, but whose reply has not been written yet
+
+    /// Latency statistics per priority class, indexed by Priority.
+    std::array<PriorityClassMetrics, PriorityCount> classes;
+};
+
+/**
+ * What an RpcService does when a connection reaches one of the in-flight limits.
+ */
+enum class OverloadPolicy
+{
+    Pause,  ///< stop reading from the connection until calls have completed, so that TCP backpressure applies
+    Shed    ///< keep reading, but refuse new calls with an overloaded reply
+};
+
+/**
+ * Limits on the amount of work that an RpcService accepts. A value of zero
+ * means that there is no limit.
+ */
+struct RpcServiceLimits
+{
+    /// The maximum number of calls in flight on a single connection.
+    std::size_t maxInFlightPerConnection = 0;
+
+    /// The maximum number of calls in flight on all connections together.
+    std::size_t maxInFlight = 0;
+
+    /// The maximum number of reply bytes that may be waiting to be written to a
+    /// single connection. Reaching this limit always pauses reading, because
+    /// refusing calls would only add more replies.
+    std::size_t maxOutboundBytes = 0;
+
+    /// What to do when one of the in-flight limits is reached.
+    OverloadPolicy overloadPolicy = OverloadPolicy::Pause;
+};
+
+/**
+ * How an RpcService chooses between calls of different priority classes.
+ */
+enum class SchedulingPolicy
+{
+    Strict,     ///< always run a call of the highest class that has waiting calls
+    Weighted    ///< run calls of each class in proportion to the weight of the class
+};
+
+/**
+ * Scheduling options of an RpcService.
+ */
+struct RpcServiceScheduling
+{
+    SchedulingPolicy policy = SchedulingPolicy::Strict;
+
+    /// For the weighted policy: the number of calls of each class, indexed by Priority,
+    /// that are run in each round. Every weight should be at least one.
+    std::array<unsigned, PriorityCount> weights = {{ 8, 4, 1 }};
+};
+
+/**
+ * How RpcService::run() runs the io_service of the service.
+ */
+struct RpcServiceThreads
+{
+    /// The number of threads that run the io_service, including the calling thread.
+    unsigned threads = 1;
+
+    /// Whether the threads poll the io_service in a loop, see RunBusyPolling(), instead
+    /// of sleeping until there is work.
+    bool busyPolling = false;
+    BusyPollOptions busyPollOptions;
+
+    /// Whether to pin the threads to consecutive processor cores, starting at firstCore.
+    bool pinned = false;
+    unsigned firstCore = 0;
+};
+
+/**
+ * A connection of an RpcService, together with the bookkeeping for the
+ * RpcServiceLimits.
+ */
+class ServiceConnection : public connection
+{
+public:
+    ServiceConnection( boost::asio::io_service &io_service, std::shared_ptr<BufferPool> buffers)
+    : connection( io_service, std::move( buffers), sizeof( ServiceConnection))
+    {
+    }
+
+    std::size_t inFlight = 0;   ///< calls on this connection whose reply has not been written yet
+    bool        reading = false;///< whether a read of the next message is in progress
+    bool        paused = false; ///< whether reading has been paused because of a limit
+    bool        closed = false; ///< whether the other side has closed the connection
+
+    /// Messages that were read but not accepted yet. While a read is in progress, only the
+    /// read handler uses these two members, so it can do so without the service mutex.
+    std::deque<RpcMessage>  decoded;
+    std::size_t             burst = 1;  ///< how many messages the current read may decode
+};
+
+typedef boost::shared_ptr<ServiceConnection> ServiceConnectionPtr;
+
+/**
+ * An RpcService object has a registry of named FunctionInterface pointers. It
  * will listen for connections and then for each connection start a sequence of
  * reading RpcMessages, calling the appropriate function and writing RpcReplies
  * with the function results.
+ *
+ * Functions that return a Generator are registered as StreamFunctionInterface
+ * pointers. Their values are written as a series of RpcReplies that all carry
+ * the request id of the RpcMessage.
+ *
+ * If an RpcMessage carries a timeout, the service will not call the function
+ * once the timeout has expired, because the client will have stopped waiting
+ * for the result.
+ *
+ * Calls are not run as soon as their message is read. Instead they wait in a run
+ * queue for the priority class of their function, from which the service picks
+ * the next call according to the RpcServiceScheduling. The deadline of a call is
+ * checked just before it is started.
+ *
+ * A call is in flight from the moment its message is read until its (last) reply
+ * has been written. The RpcServiceLimits determine how many calls may be in flight
+ * and how many reply bytes may be queued, before the service stops reading from a
+ * connection or starts refusing calls.
+ *
+ * The io_service of the service may be run by any number of threads. The run queues,
+ * the limits and the metrics are protected by a mutex, which is not held while the
+ * functions run, so that calls run in parallel on those threads.
  */
 class RpcService
 {
 public:
+    typedef std::chrono::steady_clock Clock;
+
     /// Constructor opens the acceptor and starts waiting for the first incoming
     /// connection.
-    RpcService(boost::asio::io_service& io_service, unsigned short port)
-    :m_acceptor(io_service,
+    RpcService(
+        boost::asio::io_service& io_service,
+        unsigned short port,
+        const RpcServiceLimits &limits = RpcServiceLimits{},
+        const RpcServiceScheduling &scheduling = RpcServiceScheduling{})
+    :m_limits( limits),
+     m_scheduling( scheduling),
+     m_captureFlush( io_service),
+     m_acceptor(io_service,
         boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port))
     {
 
             // Start an accept operation for a new connection.
-            connection_ptr new_conn(new connection(m_acceptor.get_io_service()));
+            ServiceConnectionPtr new_conn(new ServiceConnection(m_acceptor.get_io_service(), m_buffers));
             m_acceptor.async_accept(new_conn->socket(),
                 boost::bind(&RpcService::handle_accept, this,
                     boost::asio::placeholders::error, new_conn));
     }
 
     /**
-     * Register a FunctionInterface instance by name.
+     * Set the socket options, like SocketOptions::LowLatency(), of connections that
+     * are accepted from now on.
      */
-    void register_function( const std::string &name, const std::shared_ptr<FunctionInterface> &function)
+    void set_socket_options( const SocketOptions &options)
     {
-        m_functions[name] = function;
+        m_socketOptions = options;
     }
 
     /**
-     * Register a free function by name.
+     * Let connections that are accepted from now on send and receive with the given
+     * transport. Returns false if the transport is not available, in which case the
+     * connections keep using the reactor of the io_service.
+     */
+    bool set_transport( Transport transport, const IoUringOptions &options = IoUringOptions{})
+    {
+        if (transport == Transport::IoUring && !IoUringTransport::of( m_acceptor.get_io_service(), options))
+        {
+            return false;
+        }
+        m_transport = transport;
+        m_ioUringOptions = options;
+        return true;
+    }
+
+    /**
+     * Run the io_service of the service on a number of threads, until it is stopped or
+     * runs out of work. The calling thread is one of those threads.
+     *
+     * Busy polling threads avoid the latency of waking up when a message arrives, at the
+     * cost of keeping their cores busy. Pinned threads keep their caches warm. Pinning is
+     * best effort: a thread that can not be pinned runs anyway.
+     */
+    void run( const RpcServiceThreads &options = RpcServiceThreads{})
+    {
+        auto &io_service = m_acceptor.get_io_service();
+        auto runner = [&io_service, &options]( unsigned index)
+            {
+                if (options.pinned) PinThreadToCore( options.firstCore + index);
+
+                if (options.busyPolling)
+                {
+                    RunBusyPolling( io_service, options.busyPollOptions);
+                }
+                else
+                {
+                    io_service.run();
+                }
+            };
+
+        std::vector<std::thread> threads;
+        for (unsigned index = 1; index < options.threads; ++index)
+        {
+            threads.emplace_back( runner, index);
+        }
+        runner( 0);
+        for (auto &thread : threads) thread.join();
+    }
+
+    /**
+     * Start appending every message that the service receives, with the time at which
+     * it was received, to a capture file. The capture can be replayed against a service
+     * with rpc_replay. Returns false if the file can not be opened.
+     *
+     * This can be called at any time. The capture includes connections that were
+     * accepted before it started. The file is flushed every second.
+     */
+    bool start_capture( const std::string &path)
+    {
+        if (!m_capture->start( path)) return false;
+        m_acceptor.get_io_service().post( [this]{ flush_capture_later();});
+        return true;
+    }
+
+    void stop_capture()
+    {
+        m_capture->stop();
+    }
+
+    /**
+     * The memory that the connections of this service use. Connections share their
+     * receive buffers, so idle connections only cost the connection objects themselves.
+     */
+    ConnectionMemory connection_memory() const
+    {
+        return m_buffers->memory();
+    }
+
+    /// Counters that describe the work that this service has done so far.
+    RpcServiceMetrics metrics() const
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        return m_metrics;
+    }
+
+    /**
+     * Register a FunctionInterface instance by name, in the given priority class.
+     *
+     * Functions can be registered, replaced and unregistered at any time, from any thread,
+     * also while the service is handling calls. Calls that are already in progress complete
+     * with the function that they started with.
+     */
+    void register_function(
+        const std::string &name,
+        const std::shared_ptr<FunctionInterface> &function,
+        Priority priority = Priority::Normal)
+    {
+        RegisteredFunction registration;
+        registration.function = function;
+        registration.priority = priority;
+        m_registry.add( name, registration);
+    }
+
+    /**
+     * Register a StreamFunctionInterface instance by name, in the given priority class.
+     *
+     * Every value that the function generates is sent to the client as a separate
+     * frame, as soon as it has been produced. Producing each value counts as a
+     * separate call in the run queue of the priority class.
+     */
+    void register_function(
+        const std::string &name,
+        const std::shared_ptr<StreamFunctionInterface> &function,
+        Priority priority = Priority::Normal)
+    {
+        RegisteredFunction registration;
+        registration.stream = function;
+        registration.priority = priority;
+        m_registry.add( name, registration);
+    }
+
+    /**
+     * Register a free function or a function object, like a lambda, by name.
      *
      * This will create a wrapper on top of the function that implements the FunctionInterface
-     * interface.
+     * interface, or the StreamFunctionInterface interface if the function returns a Generator.
      */
     template< typename FunctionType>
     void register_function(
         const std::string &name,
-        FunctionType function)
+        FunctionType function,
+        Priority priority = Priority::Normal)
     {
-        register_function( name, Wrap( function));
+        register_function( name, Wrap( std::move( function)), priority);
+    }
+
+    /**
+     * Remove a function. Calls of the function that are already queued or running
+     * still complete, later calls get an unknown-function error.
+     */
+    bool unregister_function( const std::string &name)
+    {
+        return m_registry.remove( name);
     }
 
     /// Handle completion of a accept operation.
-    void handle_accept(const boost::system::error_code& e, connection_ptr conn)
+    void handle_accept(const boost::system::error_code& e, ServiceConnectionPtr conn)
     {
         using namespace boost::placeholders;
 
         if (!e)
         {
-            conn->async_read<RpcMessage>(
-                [this, conn](const boost::system::error_code& e, const RpcMessage &message = {})
-                {
-                handle_read( e, conn, message);
-                }
-            );
+            conn->set_options( m_socketOptions);
+            conn->set_transport( m_transport, m_ioUringOptions);
+            conn->set_capture( m_capture);
+            std::lock_guard<std::mutex> lock{ m_mutex};
+            read_next( conn);
         }
 
         // Start an accept operation for a new connection.
-        connection_ptr new_conn(new connection(m_acceptor.get_io_service()));
+        ServiceConnectionPtr new_conn(new ServiceConnection(m_acceptor.get_io_service(), m_buffers));
         m_acceptor.async_accept(new_conn->socket(),
             boost::bind(&RpcService::handle_accept, this,
                 boost::asio::placeholders::error, new_conn));
@@ -87,54 +383,475 @@ public:
     /**
      * Handle the completion of an RpcMessage read operation.
      *
-     * This will try to find the corresponding function for the message and call it.
+     * This will try to find the corresponding function for the message and queue a call to it.
      */
-    void handle_read(const boost::system::error_code& e, connection_ptr conn, const RpcMessage &message = {})
+    void handle_read(const boost::system::error_code& e, ServiceConnectionPtr conn, RpcMessage message = {})
     {
-        using std::get;
         if (!e)
         {
-            // we received an RpcMessage, call the corresponding function.
-            // and send the result back to the receiver.
-            auto result = m_functions[get<0>(message)]->Call(get<1>(message));
-            conn->async_write(
-                result,
-                boost::bind(&RpcService::handle_write, this,
-                    boost::asio::placeholders::error, conn));
-
-            // also start a read for the next message.
-            conn->async_read<RpcMessage>(
-                [this, conn](const boost::system::error_code& e, const RpcMessage &message = {})
-                {
-                    handle_read( e, conn, message);
-                }
-            );
+            // Messages that have already arrived completely are read right away, so that the
+            // scheduler can choose between them before the first of them is run. Receiving and
+            // decoding them needs no lock, because conn->reading keeps other reads away.
+            conn->decoded.push_back( std::move( message));
+            while (conn->decoded.size() < conn->burst && !outbound_limit_reached( *conn) && conn->try_read( message))
+            {
+                conn->decoded.push_back( std::move( message));
+            }
+        }
+
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        conn->reading = false;
+        if (!e)
+        {
+            // queue the calls and start a read for the next message.
+            read_next( conn);
         }
         else
         {
-            // do nothing, read failed is a normal condition when the
+            // read failed is a normal condition when the
             // other side closes the connection.
+            conn->closed = true;
         }
     }
 
     /**
      * Handle a finished write of the function results.
      *
-     * This does nothing except for some error handling, the read of the next message was already
-     * scheduled.
+     * The call is no longer in flight, which may allow reading to resume on connections
+     * that were paused.
      */
-    void handle_write(const boost::system::error_code& e, connection_ptr conn)
+    void handle_write(const boost::system::error_code& e, ServiceConnectionPtr conn)
     {
         if (e)
         {
             std::cerr << "write failed: " << e.message() << '\n';
         }
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        end_call( conn);
     }
 
 private:
+    /// Flush the capture file in a second, and every second after that, until the capture stops.
+    void flush_capture_later()
+    {
+        m_captureFlush.expires_from_now( std::chrono::seconds( 1));
+        m_captureFlush.async_wait(
+            [this]( const boost::system::error_code &e)
+            {
+                if (e || !m_capture->active()) return;
+                m_capture->flush();
+                flush_capture_later();
+            });
+    }
+
+    /// The maximum number of messages that are read from a connection in one go.
+    enum { max_burst = 64 };
+
+    // The member functions from here up to write_reply() must be called with m_mutex locked.
+
+    /// Queue a call for a message that was just read, or refuse it if the service is overloaded.
+    void accept_message( const ServiceConnectionPtr &conn, RpcMessage message)
+    {
+        ++m_metrics.requests;
+
+        if (m_limits.overloadPolicy == OverloadPolicy::Shed && over_in_flight_limit( *conn))
+        {
+            ++m_metrics.shed;
+            write_overloaded( conn, std::get<0>(message));
+        }
+        else
+        {
+            begin_call( conn);
+            queue_call( conn, std::move( message));
+        }
+    }
+
+    /// A unit of work that waits in a run queue.
+    struct Task
+    {
+        ServiceConnectionPtr    conn;
+        Clock::time_point       received;   ///< when the message was read
+        Clock::time_point       deadline;
+        Clock::time_point       queued;     ///< when the task was added to its run queue
+        std::function<void ()>  run;
+    };
+
+    /**
+     * Look up the function that was requested and queue a call to it in the run queue of
+     * its priority class.
+     */
+    void queue_call( const ServiceConnectionPtr &conn, RpcMessage message)
+    {
+        using std::get;
+        const auto received = Clock::now();
+        const auto id = get<0>(message);
+        const auto deadline = deadline_of( received, get<1>(message));
+        const auto &name = get<2>(message);
+        auto parameters = std::make_shared<Blob>( std::move( get<3>(message)));
+
+        RegisteredFunction registration;
+        if (!m_registry.find( name, registration))
+        {
+            ++m_metrics.errors;
+            const std::string message = "unknown function: " + name;
+            write_reply( conn, id, ReplyType::Error, Blob( message.begin(), message.end()));
+            return;
+        }
+
+        const auto priority = registration.priority;
+        if (registration.stream)
+        {
+            auto function = registration.stream;
+            queue_task( priority, Task{ conn, received, deadline, received,
+                [this, conn, id, deadline, priority, function, parameters]()
+                {
+                    // The values of a stream are sent as separate frames. The stream remains
+                    // in flight until its last frame has been written.
+                    std::shared_ptr<BlobGenerator> values;
+                    try
+                    {
+                        values = std::make_shared<BlobGenerator>( function->CallStream( *parameters));
+                    }
+                    catch (std::exception &error)
+                    {
+                        write_error( conn, id, error.what());
+                        return;
+                    }
+                    write_next_value( conn, id, deadline, priority, values);
+                }});
+            return;
+        }
+
+        auto function = registration.function;
+        queue_task( priority, Task{ conn, received, deadline, received,
+            [this, conn, id, function, parameters]()
+            {
+                // call the corresponding function
+                // and send the result back to the receiver.
+                try
+                {
+                    auto result = function->Call( *parameters);
+                    write_reply( conn, id, ReplyType::Result, result);
+                }
+                catch (std::exception &error)
+                {
+                    write_error( conn, id, error.what());
+                }
+            }});
+    }
+
+    void queue_task( Priority priority, Task task)
+    {
+        task.queued = Clock::now();
+        m_runQueues[static_cast<std::size_t>( priority)].push_back( std::move( task));
+        m_acceptor.get_io_service().post( [this](){ run_next();});
+    }
+
+    /**
+     * Run a single task from the run queues.
+     *
+     * One run_next() is posted for every queued task, so that reads and writes of other
+     * connections are handled in between tasks. Each run_next() takes the task that the
+     * scheduling policy prefers at that time, which need not be the task it was posted for.
+     * The task itself runs without the mutex.
+     */
+    void run_next()
+    {
+        std::unique_lock<std::mutex> lock{ m_mutex};
+        const auto priority = next_class();
+        auto &queue = m_runQueues[priority];
+        Task task = std::move( queue.front());
+        queue.pop_front();
+
+        auto &metrics = m_metrics.classes[priority];
+        const auto start = Clock::now();
+        metrics.waiting.record( start - task.received);
+
+        if (expired( task.deadline))
+        {
+            // the client has given up on a call that has expired, don't waste any work on it.
+            ++m_metrics.expired;
+            end_call( task.conn);
+            return;
+        }
+
+        lock.unlock();
+        task.run();
+        const auto finished = Clock::now();
+
+        lock.lock();
+        metrics.latency.record( finished - task.received);
+    }
+
+    /// Select the priority class of the next task to run. There must be at least one waiting task.
+    std::size_t next_class()
+    {
+        if (m_scheduling.policy == SchedulingPolicy::Weighted)
+        {
+            for (int round = 0; round < 2; ++round)
+            {
+                for (std::size_t priority = 0; priority < PriorityCount; ++priority)
+                {
+                    if (!m_runQueues[priority].empty() && m_credits[priority])
+                    {
+                        --m_credits[priority];
+                        return priority;
+                    }
+                }
+
+                // all classes with waiting tasks have used up their share, start a new round.
+                m_credits = m_scheduling.weights;
+            }
+        }
+
+        std::size_t priority = 0;
+        while (m_runQueues[priority].empty()) ++priority;
+        return priority;
+    }
+
+    /// Queue the calls of the messages that were already read from a connection and start
+    /// reading the next RpcMessage, unless the limits require the connection to be paused.
+    void read_next( const ServiceConnectionPtr &conn)
+    {
+        if (conn->reading || conn->paused || conn->closed) return;
+
+        while (!conn->decoded.empty() && !must_pause( *conn))
+        {
+            accept_message( conn, std::move( conn->decoded.front()));
+            conn->decoded.pop_front();
+        }
+
+        if (must_pause( *conn))
+        {
+            ++m_metrics.pauses;
+            conn->paused = true;
+            m_paused.push_back( conn);
+            return;
+        }
+
+        conn->reading = true;
+        conn->burst = burst_size( *conn);
+        conn->async_read<RpcMessage>(
+            [this, conn](const boost::system::error_code& e, RpcMessage &&message = RpcMessage{})
+            {
+                handle_read( e, conn, std::move( message));
+            }
+        );
+    }
+
+    /// The number of messages that the next read from a connection may decode: at most
+    /// max_burst, and no more than the in-flight limits of the pause policy leave room for.
+    std::size_t burst_size( const ServiceConnection &conn) const
+    {
+        std::size_t burst = max_burst;
+        if (m_limits.overloadPolicy == OverloadPolicy::Pause)
+        {
+            if (m_limits.maxInFlightPerConnection)
+            {
+                burst = std::min( burst, m_limits.maxInFlightPerConnection - std::min( conn.inFlight, m_limits.maxInFlightPerConnection));
+            }
+            if (m_limits.maxInFlight)
+            {
+                burst = std::min( burst, m_limits.maxInFlight - std::min( m_metrics.inFlight, m_limits.maxInFlight));
+            }
+        }
+        return std::max<std::size_t>( burst, 1);
+    }
+
+    /// This one needs no lock, because the connection guards its outbound bytes itself.
+    bool outbound_limit_reached( const ServiceConnection &conn) const
+    {
+        return m_limits.maxOutboundBytes && conn.outbound_bytes() >= m_limits.maxOutboundBytes;
+    }
+
+    bool over_in_flight_limit( const ServiceConnection &conn) const
+    {
+        return (m_limits.maxInFlightPerConnection && conn.inFlight >= m_limits.maxInFlightPerConnection)
+            || (m_limits.maxInFlight && m_metrics.inFlight >= m_limits.maxInFlight);
+    }
+
+    bool must_pause( const ServiceConnection &conn) const
+    {
+        if (outbound_limit_reached( conn))
+        {
+            return true;
+        }
+        return m_limits.overloadPolicy == OverloadPolicy::Pause && over_in_flight_limit( conn);
+    }
+
+    void begin_call( const ServiceConnectionPtr &conn)
+    {
+        ++conn->inFlight;
+        ++m_metrics.inFlight;
+    }
+
+    /// Administer the end of a call and resume reading from connections that no longer
+    /// need to be paused.
+    void end_call( const ServiceConnectionPtr &conn)
+    {
+        --conn->inFlight;
+        --m_metrics.inFlight;
+        resume_paused();
+    }
+
+    /// Resume reading from paused connections that no longer need to be paused.
+    ///
+    /// This must be called whenever a call ends and whenever a write finishes, because
+    /// a connection can be paused for its outbound bytes while none of its calls are in flight.
+    void resume_paused()
+    {
+        for (auto paused = m_paused.begin(); paused != m_paused.end();)
+        {
+            ServiceConnectionPtr candidate = *paused;
+            if (must_pause( *candidate))
+            {
+                ++paused;
+            }
+            else
+            {
+                paused = m_paused.erase( paused);
+                candidate->paused = false;
+                read_next( candidate);
+            }
+        }
+    }
+
+    // The member functions from here on can be called with or without m_mutex locked, except
+    // for write_error() and write_next_value(), which take the mutex themselves.
+
+    void write_reply( const ServiceConnectionPtr &conn, RequestId id, ReplyType type, const Blob &blob)
+    {
+        conn->async_write(
+            std::tie( id, type, blob),
+            boost::bind(&RpcService::handle_write, this,
+                boost::asio::placeholders::error, conn));
+    }
+
+    void write_error( const ServiceConnectionPtr &conn, RequestId id, const std::string &message)
+    {
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex};
+            ++m_metrics.errors;
+        }
+        write_reply( conn, id, ReplyType::Error, Blob( message.begin(), message.end()));
+    }
+
+    /// Refuse a call. The call was never in flight, so writing the reply does not end it,
+    /// but it may free enough outbound bytes to resume a paused connection.
+    void write_overloaded( const ServiceConnectionPtr &conn, RequestId id)
+    {
+        auto type = ReplyType::Overloaded;
+        const Blob none;
+        conn->async_write(
+            std::tie( id, type, none),
+            [this]( const boost::system::error_code &e, std::size_t = 0)
+            {
+                if (e)
+                {
+                    std::cerr << "write failed: " << e.message() << '\n';
+                }
+                std::lock_guard<std::mutex> lock{ m_mutex};
+                resume_paused();
+            });
+    }
+
+    /**
+     * Send the next value of a stream, or the end-of-stream marker if the stream is exhausted.
+     *
+     * The next value is only produced after the previous one has been written, so that a
+     * stream never holds more than one value in memory. Producing the next value is queued
+     * as a new task, so that a long stream does not delay calls of a higher priority.
+     */
+    void write_next_value(
+        const ServiceConnectionPtr &conn,
+        RequestId id,
+        Clock::time_point deadline,
+        Priority priority,
+        std::shared_ptr<BlobGenerator> values)
+    {
+        auto type = ReplyType::StreamItem;
+        Blob value;
+        try
+        {
+            if (!(*values)( value))
+            {
+                type = ReplyType::StreamEnd;
+            }
+        }
+        catch (std::exception &error)
+        {
+            write_error( conn, id, error.what());
+            return;
+        }
+
+        if (type == ReplyType::StreamEnd)
+        {
+            write_reply( conn, id, type, value);
+            return;
+        }
+
+        conn->async_write(
+            std::tie( id, type, value),
+            [this, conn, id, deadline, priority, values]( const boost::system::error_code &e, std::size_t = 0)
+            {
+                if (e)
+                {
+                    handle_write( e, conn);
+                    return;
+                }
+
+                std::lock_guard<std::mutex> lock{ m_mutex};
+                resume_paused();
+                const auto now = Clock::now();
+                queue_task( priority, Task{ conn, now, deadline, now,
+                    [this, conn, id, deadline, priority, values]()
+                    {
+                        write_next_value( conn, id, deadline, priority, values);
+                    }});
+            });
+    }
+
+    /// Determine the deadline of a call from the moment its message was read.
+    static Clock::time_point deadline_of( Clock::time_point received, TimeoutMicroseconds timeout)
+    {
+        if (!timeout) return Clock::time_point::max();
+        return received + std::chrono::microseconds( timeout);
+    }
+
+    static bool expired( Clock::time_point deadline)
+    {
+        return deadline != Clock::time_point::max() && Clock::now() >= deadline;
+    }
+
+    FunctionRegistry                  m_registry;
+
+    /// Protects the metrics, the run queues, the paused connections and the bookkeeping
+    /// of the connections, which are used by all threads that run the io_service.
+    mutable std::mutex                m_mutex;
+    RpcServiceMetrics                 m_metrics;
+    const RpcServiceLimits            m_limits;
+    const RpcServiceScheduling        m_scheduling;
+    SocketOptions                     m_socketOptions;
+    Transport                         m_transport = Transport::Asio;
+    IoUringOptions                    m_ioUringOptions;
+
+    /// The capture that every connection records its received frames in, when it is active.
+    std::shared_ptr<TrafficCapture>   m_capture = std::make_shared<TrafficCapture>();
+    boost::asio::steady_timer         m_captureFlush;
+
+    /// The receive buffers that the connections share. Connections may outlive the service.
+    std::shared_ptr<BufferPool>       m_buffers = std::make_shared<BufferPool>();
+
+    /// Tasks that wait to be run, per priority class.
+    std::array<std::deque<Task>, PriorityCount> m_runQueues;
+
+    /// For the weighted policy: the number of tasks that each class may still run in this round.
+    std::array<unsigned, PriorityCount> m_credits{};
+
+    /// Connections that are not being read from because of the limits.
+    std::list<ServiceConnectionPtr>   m_paused;
+
     /// The acceptor object used to accept incoming socket connections.
-    typedef std::map< std::string, std::shared_ptr<FunctionInterface>> FunctionMap;
-    FunctionMap                       m_functions;
     boost::asio::ip::tcp::acceptor    m_acceptor;
 
 };
@@ -0,0 +1,142 @@
+//
+//  Copyright (C) 2017 Danny Havenith
+//
+//  Distributed under the Boost Software License, Version 1.0. (See
+//  accompanying file LICENSE_1_0.txt or copy at
+//  http://www.boost.org/LICENSE_1_0.txt)
+//
+#ifndef TRAFFIC_CAPTURE_HPP_
+#define TRAFFIC_CAPTURE_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+
+/**
+ * The header of a record in a capture file.
+ *
+ * A capture file is a sequence of records, each of which consists of this header,
+ * followed by a frame exactly as it was received: the 8-byte hexadecimal size and
+ * the serialized RpcMessage. Numbers are in the byte order of the machine that
+ * made the capture.
+ *
+ * A record without a frame (of size 0) marks the start of a capture session. Its
+ * timestamp is the wall-clock time of that start. The timestamps of the frames
+ * that follow are measured from the start of the session with a steady clock, so
+ * within a session, records are in the order of their timestamps, even if the
+ * system clock is adjusted during the capture.
+ */
+struct CaptureRecordHeader
+{
+    /// For a session marker: when the session started, in microseconds since the system clock epoch.
+    /// For a frame: when it was received, in microseconds since the start of its session.
+    std::uint64_t timestamp;
+    std::uint32_t connection;   ///< the connection that received the frame, unique within one capture session
+    std::uint32_t size;         ///< the size of the frame that follows
+};
+
+/**
+ * Writes the frames that connections receive to a capture file, so that the
+ * traffic can be replayed later, for instance by rpc_replay.
+ *
+ * The file is only ever appended to, so captures of several sessions can be
+ * collected in one file. Frames are written from the threads that receive
+ * them, through a buffered stream, so a capture costs some throughput. When
+ * no capture is active, a connection only checks a flag. The owner of the
+ * capture should flush it regularly, so that little is lost if the process
+ * is killed.
+ */
+class TrafficCapture
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    TrafficCapture() = default;
+    TrafficCapture( const TrafficCapture &) = delete;
+    TrafficCapture &operator=( const TrafficCapture &) = delete;
+
+    /// Start appending frames to the given file. Returns false if the file can not be opened.
+    bool start( const std::string &path)
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        if (m_file.is_open()) m_file.close();
+        m_file.open( path, std::ios::binary | std::ios::app);
+        m_active = m_file.is_open();
+        if (m_active)
+        {
+            m_sessionStart = Clock::now();
+            write( microseconds( std::chrono::system_clock::now().time_since_epoch()), 0, nullptr, 0);
+        }
+        return m_active;
+    }
+
+    /// Stop capturing and close the file.
+    void stop()
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        m_active = false;
+        if (m_file.is_open()) m_file.close();
+    }
+
+    bool active() const
+    {
+        return m_active;
+    }
+
+    /// Return a number that identifies a new connection in the capture.
+    std::uint32_t new_connection()
+    {
+        return ++m_connections;
+    }
+
+    /// Write the buffered frames to the file.
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        if (m_active) m_file.flush();
+    }
+
+    /// Append a received frame to the capture file.
+    void record( std::uint32_t connection, const char *frame, std::size_t size)
+    {
+        // the record is time-stamped while the lock is held, so that the timestamps in
+        // the file never go back in time.
+        std::lock_guard<std::mutex> lock{ m_mutex};
+        if (m_active) write( microseconds( Clock::now() - m_sessionStart), connection, frame, size);
+    }
+
+private:
+    template<typename Duration>
+    static std::uint64_t microseconds( Duration duration)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>( duration).count();
+    }
+
+    void write( std::uint64_t timestamp, std::uint32_t connection, const char *frame, std::size_t size)
+    {
+        CaptureRecordHeader header;
+        header.timestamp = timestamp;
+        header.connection = connection;
+        header.size = static_cast<std::uint32_t>( size);
+
+        m_file.write( reinterpret_cast<const char *>( &header), sizeof header);
+        m_file.write( frame, size);
+        if (!m_file)
+        {
+            // a full disk should not bring the service down, stop capturing instead.
+            m_active = false;
+            m_file.close();
+        }
+    }
+
+    std::mutex                  m_mutex;
+    std::ofstream               m_file;
+    Clock::time_point           m_sessionStart;
+    std::atomic<bool>           m_active{ false};
+    std::atomic<std::uint32_t>  m_connections{ 0};
+};
+
+#endif /* TRAFFIC_CAPTURE_HPP_ */